@@ -25,585 +25,4851 @@
  */
 #include "threads.h"
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+#ifdef _WIN32
 #include <process.h>
+#endif // _WIN32
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
- // TLS counts is limited to 1088 = 64 + 1024
-#define _DTORS_COUNT (64 + 1024)
+#if defined(_MSC_VER) && defined(WINCTHREADS_STATIC)
+// The users of the static library link it without the project settings.
+#pragma comment(lib, "Synchronization.lib")
+#endif
 
-// An array of all the destructors
-static tss_dtor_t _Dtors[_DTORS_COUNT];
+#ifndef _WIN32
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // !_WIN32
 
-// A list of all keys
-typedef struct _Tss_dtor_id_node
+#define _NS_PER_SEC 1000000000LL
+#define _NS_PER_MS 1000000LL
+
+// The deadline of waiting forever
+#define _NO_DEADLINE MAXLONGLONG
+
+// Remaining time below which the waits spin instead of sleeping,
+// because the timers cannot wake us in time.
+// The default timer slack of Linux, and about the precision of the high resolution timers of Windows.
+#define _WAIT_SPIN_NS 50000LL
+#ifdef _WIN32
+// WaitOnAddress takes whole milliseconds, thus the last millisecond sleeps on the timer in slices,
+// and a notification is seen at most this late.
+#define _WAIT_SLICE_NS 100000LL
+#endif // _WIN32
+
+static LONGLONG _Timespec_ns(const struct timespec* t)
 {
-	tss_t _Key;
-	struct _Tss_dtor_id_node* _Next;
-} _Tss_dtor_id_node;
+	// Saturate instead of overflow for time points far away.
+	if (t->tv_sec >= _NO_DEADLINE / _NS_PER_SEC - 1) return _NO_DEADLINE;
+	return (LONGLONG)t->tv_sec * _NS_PER_SEC + t->tv_nsec;
+}
 
-static thread_local _Tss_dtor_id_node* _All_dtor_head = NULL;
+static void _Timespec_from_ns(struct timespec* t, LONGLONG ns)
+{
+	t->tv_sec = (time_t)(ns / _NS_PER_SEC);
+	t->tv_nsec = (long)(ns % _NS_PER_SEC);
+}
 
-// Add a destructor and its key to the list
-static void _Add_dtor_id(_In_ tss_t key)
+// Gets the monotonic time in nanoseconds.
+static LONGLONG _Mono_now(void)
 {
-	_Tss_dtor_id_node* node = malloc(sizeof(_Tss_dtor_id_node));
-	if (node)
+#ifdef _WIN32
+	// The frequency is fixed at system boot.
+	static LONGLONG freq = 0;
+	if (!freq)
 	{
-		node->_Key = key;
-		node->_Next = _All_dtor_head;
-		_All_dtor_head = node;
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		freq = f.QuadPart;
 	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart / freq * _NS_PER_SEC + counter.QuadPart % freq * _NS_PER_SEC / freq;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return _Timespec_ns(&now);
+#endif // _WIN32
 }
 
-// Clear all remained data TSS_DTOR_ITERATIONS times,
-// And free them
-static void _Tss_clear_all(void)
+// The ticks of the performance counter, cheaper than _Mono_now
+// for the instrumentation, and converted only when recorded.
+static double _Ns_per_tick = 1.0;
+
+static void _Ticks_init(void)
 {
-	bool again = true;
-	for (int i = 0; i < TSS_DTOR_ITERATIONS && again; i++)
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	_Ns_per_tick = (double)_NS_PER_SEC / (double)freq.QuadPart;
+#endif // _WIN32
+}
+
+static LONGLONG _Ticks_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	return _Mono_now();
+#endif // _WIN32
+}
+
+static ULONGLONG _Ticks_ns(LONGLONG ticks)
+{
+	return ticks > 0 ? (ULONGLONG)((double)ticks * _Ns_per_tick) : 0;
+}
+
+// Converts a time point of the base to a monotonic deadline,
+// so that the waits are not affected by the changes of the wall clock.
+// Returns false if the base is not supported.
+static bool _Deadline_from(const struct timespec* time_point, int base, LONGLONG* deadline)
+{
+	LONGLONG target = _Timespec_ns(time_point);
+	if (base == TIME_MONOTONIC)
 	{
-		again = false;
-		for (_Tss_dtor_id_node* current = _All_dtor_head; current; current = current->_Next)
+		*deadline = target;
+		return true;
+	}
+	struct timespec now;
+	if (base != TIME_UTC || !timespec_get(&now, TIME_UTC)) return false;
+	LONGLONG span = target - _Timespec_ns(&now);
+	LONGLONG mono = _Mono_now();
+	*deadline = span >= _NO_DEADLINE - mono ? _NO_DEADLINE : mono + span;
+	return true;
+}
+
+#ifdef _WIN32
+// Converts a deadline to the milliseconds to wait, rounded up.
+static DWORD _Deadline_ms(LONGLONG deadline)
+{
+	if (deadline == _NO_DEADLINE) return INFINITE;
+	LONGLONG span = deadline - _Mono_now();
+	if (span <= 0) return 0;
+	LONGLONG ms = (span + _NS_PER_MS - 1) / _NS_PER_MS;
+	return ms >= (LONGLONG)INFINITE ? INFINITE - 1 : (DWORD)ms;
+}
+#endif // _WIN32
+
+int __cdecl _Timespec_get(_Out_ struct timespec* ts, int base)
+{
+	if (base == TIME_MONOTONIC)
+	{
+		_Timespec_from_ns(ts, _Mono_now());
+		return base;
+	}
+	return timespec_get(ts, base);
+}
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif // !CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+
+// The high resolution timer of the calling thread,
+// INVALID_HANDLE_VALUE if not supported.
+static thread_local HANDLE _Thrd_timer = NULL;
+
+static HANDLE _Thrd_timer_create(void)
+{
+	HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	return timer ? timer : INVALID_HANDLE_VALUE;
+}
+
+// Whether the calling thread is created by the library, and closes the timer when exits.
+static bool _Thrd_is_own(void);
+
+// Sleeps span nanoseconds on the high resolution timer.
+// Returns the result of waiting, or WAIT_ABANDONED if the timer is not supported.
+static DWORD _Thrd_timer_sleep(LONGLONG span, BOOL alertable)
+{
+	// Cache the timer only for the threads whose exit we know.
+	HANDLE timer = _Thrd_timer;
+	if (!timer)
+	{
+		timer = _Thrd_timer_create();
+		if (_Thrd_is_own()) _Thrd_timer = timer;
+	}
+	if (timer == INVALID_HANDLE_VALUE) return WAIT_ABANDONED;
+	// Relative time in 100 nanoseconds.
+	LARGE_INTEGER due;
+	due.QuadPart = -(span / 100);
+	DWORD r;
+	if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
+		r = WaitForSingleObjectEx(timer, INFINITE, alertable);
+	else
+		r = WAIT_FAILED;
+	if (timer != _Thrd_timer) CloseHandle(timer);
+	return r;
+}
+
+static void _Thrd_timer_close(void)
+{
+	if (_Thrd_timer && _Thrd_timer != INVALID_HANDLE_VALUE)
+		CloseHandle(_Thrd_timer);
+	_Thrd_timer = NULL;
+}
+#else
+static void _Thrd_timer_close(void) {}
+#endif // _WIN32
+
+// Makes the calling thread clean up when it exits, if it is not created by the library.
+static void _Thrd_exit_arm(void);
+
+// Blocks while *address == compare, or until the deadline.
+// Returns false if the deadline has passed, and it may return spuriously.
+static bool _Atomic_wait(volatile LONG* address, LONG compare, LONGLONG deadline)
+{
+	LONGLONG span = 0;
+	if (deadline != _NO_DEADLINE)
+	{
+		span = deadline - _Mono_now();
+		if (span <= 0) return false;
+		if (span < _WAIT_SPIN_NS)
 		{
-			if (_Dtors[current->_Key])
+			// Too short to sleep, yield until changed or timed out.
+			while (ReadAcquire(address) == compare)
 			{
-				void* value = TlsGetValue(current->_Key);
-				if (value)
-				{
-					BOOL r = TlsSetValue(current->_Key, NULL);
-					assert(r);
-					again = true;
-					_Dtors[current->_Key](value);
-				}
+				if (_Mono_now() >= deadline) return false;
+				SwitchToThread();
 			}
+			return true;
+		}
+#ifdef _WIN32
+		if (span < _NS_PER_MS)
+		{
+			// Returns spuriously after a slice, and the caller checks the address again.
+			LONGLONG slice = span - _WAIT_SPIN_NS;
+			if (slice > _WAIT_SLICE_NS) slice = _WAIT_SLICE_NS;
+			if (ReadAcquire(address) != compare) return true;
+			if (_Thrd_timer_sleep(slice, FALSE) == WAIT_ABANDONED)
+				WaitOnAddress(address, &compare, sizeof(LONG), 1);
+			return true;
 		}
+#endif // _WIN32
+	}
+#ifdef _WIN32
+	// Truncated, and the last millisecond sleeps on the timer by the next calls.
+	DWORD ms = deadline == _NO_DEADLINE ? INFINITE : (DWORD)(span / _NS_PER_MS >= (LONGLONG)INFINITE ? INFINITE - 1 : span / _NS_PER_MS);
+	if (WaitOnAddress(address, &compare, sizeof(LONG), ms))
+		return true;
+	return GetLastError() != ERROR_TIMEOUT || _Mono_now() < deadline;
+#else
+	struct timespec abs_time;
+	_Timespec_from_ns(&abs_time, deadline);
+	// FUTEX_WAIT_BITSET takes an absolute time of CLOCK_MONOTONIC.
+	long r = syscall(SYS_futex, address, FUTEX_WAIT_BITSET_PRIVATE, compare, deadline == _NO_DEADLINE ? NULL : &abs_time, NULL, FUTEX_BITSET_MATCH_ANY);
+	return r == 0 || errno != ETIMEDOUT;
+#endif // _WIN32
+}
+
+static void _Atomic_notify_one(volatile LONG* address)
+{
+#ifdef _WIN32
+	WakeByAddressSingle((PVOID)address);
+#else
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif // _WIN32
+}
+
+static void _Atomic_notify_all(volatile LONG* address)
+{
+#ifdef _WIN32
+	WakeByAddressAll((PVOID)address);
+#else
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif // _WIN32
+}
+
+// States of a lock word
+#define _WORD_UNLOCKED 0
+#define _WORD_LOCKED 1
+#define _WORD_CONTENDED 2
+
+// Times to spin before parking on the lock word
+#define _WORD_SPIN_COUNT 64
+
+static bool _Mtx_word_trylock(volatile LONG* word)
+{
+	return ReadNoFence(word) == _WORD_UNLOCKED &&
+		InterlockedCompareExchange(word, _WORD_LOCKED, _WORD_UNLOCKED) == _WORD_UNLOCKED;
+}
+
+// The slow path of locking a lock word.
+static int _Mtx_word_lock_slow(volatile LONG* word, LONGLONG deadline)
+{
+	// Spin a while in case the owner is about to unlock,
+	// but stop as soon as there are other threads parked.
+	for (int i = 0; i < _WORD_SPIN_COUNT; i++)
+	{
+		LONG state = ReadNoFence(word);
+		if (state == _WORD_CONTENDED) break;
+		if (state == _WORD_UNLOCKED && InterlockedCompareExchange(word, _WORD_LOCKED, _WORD_UNLOCKED) == _WORD_UNLOCKED)
+			return thrd_success;
+		YieldProcessor();
 	}
-	_Tss_dtor_id_node* current = _All_dtor_head;
-	while (current)
+	// Mark the word contended, so that the owner will wake a waiter on unlock.
+	// Once we get the lock here, the word remains contended,
+	// because there may be other waiters.
+	while (InterlockedExchange(word, _WORD_CONTENDED) != _WORD_UNLOCKED)
 	{
-		_Tss_dtor_id_node* next = current->_Next;
-		BOOL r = TlsFree(current->_Key);
-		assert(r);
-		free(current);
-		current = next;
+		if (!_Atomic_wait(word, _WORD_CONTENDED, deadline))
+			return thrd_timedout;
 	}
+	return thrd_success;
+}
+
+static void _Mtx_word_lock(volatile LONG* word)
+{
+	if (InterlockedCompareExchange(word, _WORD_LOCKED, _WORD_UNLOCKED) != _WORD_UNLOCKED)
+		_Mtx_word_lock_slow(word, _NO_DEADLINE);
+}
+
+static int _Mtx_word_timedlock(volatile LONG* word, LONGLONG deadline)
+{
+	if (InterlockedCompareExchange(word, _WORD_LOCKED, _WORD_UNLOCKED) == _WORD_UNLOCKED)
+		return thrd_success;
+	return _Mtx_word_lock_slow(word, deadline);
 }
 
-// Parameter for _Thrd_start
+static void _Mtx_word_unlock(volatile LONG* word)
+{
+	if (InterlockedExchange(word, _WORD_UNLOCKED) == _WORD_CONTENDED)
+		_Atomic_notify_one(word);
+}
+
+// Locks a lock word, leaving it contended even if it is not.
+static void _Mtx_word_lock_contended(volatile LONG* word)
+{
+	while (InterlockedExchange(word, _WORD_CONTENDED) != _WORD_UNLOCKED)
+		_Atomic_wait(word, _WORD_CONTENDED, _NO_DEADLINE);
+}
+
+// The size of a cache line, to keep hot fields apart
+#define _CACHE_LINE _THRD_CACHE_LINE
+
+// A thread taking part in the epoch-based reclamation
+typedef struct _Rcu_record
+{
+	// (epoch << 1) | 1 inside a read-side critical section, 0 outside.
+	// Written only by the owner, so entering costs a plain store.
+	volatile LONG _State;
+	// 1 if owned by a live thread
+	volatile LONG _Used;
+	struct _Rcu_record* _Next;
+	char _Pad[_CACHE_LINE - 2 * sizeof(LONG) - sizeof(void*)];
+} _Rcu_record;
+
+// A retired pointer, freed two epochs after it is retired
 typedef struct
 {
-	thrd_start_t _Func;
-	void* _Arg;
-} _Thrd_start_arg;
+	void* _Ptr;
+	thrd_rcu_dtor_t _Dtor;
+	LONG _Epoch;
+} _Rcu_entry;
 
-// Promise that all data will be destructed by calling thrd_exit
-static unsigned WINAPI _Thrd_start(void* arg)
+// The limbo list left by an exited thread
+typedef struct _Rcu_orphan
+{
+	struct _Rcu_orphan* _Next;
+	_Rcu_entry* _Entries;
+	size_t _Begin;
+	size_t _Count;
+} _Rcu_orphan;
+
+// Retired pointers gathered before trying to advance the epoch
+#define _RCU_BATCH 128
+
+static volatile LONG _Rcu_epoch = 0;
+// The records are never freed, so they can be scanned without locks.
+static _Rcu_record* volatile _Rcu_records = NULL;
+// Guards the orphans
+static volatile LONG _Rcu_lock = _WORD_UNLOCKED;
+static _Rcu_orphan* _Rcu_orphans = NULL;
+
+static thread_local _Rcu_record* _Rcu_self = NULL;
+static thread_local unsigned int _Rcu_depth = 0;
+// The limbo list of the calling thread, ordered by epoch
+static thread_local _Rcu_entry* _Rcu_limbo = NULL;
+static thread_local size_t _Rcu_limbo_count = 0;
+static thread_local size_t _Rcu_limbo_capacity = 0;
+static thread_local size_t _Rcu_limbo_next_scan = _RCU_BATCH;
+// Set while the destructors run, so that those retiring more pointers do not collect again.
+static thread_local bool _Rcu_collecting = false;
+
+// Makes the stores of all readers visible, and orders their later loads,
+// so that the readers need no barrier of their own.
+static void _Rcu_fence(void)
+{
+#ifdef _WIN32
+	FlushProcessWriteBuffers();
+#else
+	if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0))
+		syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0);
+#endif // _WIN32
+}
+
+static _Rcu_record* _Rcu_register(void)
 {
-	_Thrd_start_arg* start_arg = arg;
-	thrd_start_t func = start_arg->_Func;
-	void* thrd_arg = start_arg->_Arg;
-	free(arg);
+	_Rcu_record* rec = _Rcu_self;
+	if (rec) return rec;
+	for (rec = ReadPointerAcquire((PVOID volatile*)&_Rcu_records); rec; rec = rec->_Next)
+	{
+		if (!ReadNoFence(&rec->_Used) && !InterlockedCompareExchange(&rec->_Used, 1, 0)) break;
+	}
+	if (!rec)
+	{
+		rec = calloc(1, sizeof(_Rcu_record));
+		if (!rec) return NULL;
+		rec->_Used = 1;
+#ifndef _WIN32
+		syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0);
+#endif // !_WIN32
+		_Rcu_record* head = ReadPointerAcquire((PVOID volatile*)&_Rcu_records);
+		for (;;)
+		{
+			rec->_Next = head;
+			_Rcu_record* prev = InterlockedCompareExchangePointer((PVOID volatile*)&_Rcu_records, rec, head);
+			if (prev == head) break;
+			head = prev;
+		}
+	}
+	_Rcu_self = rec;
+	_Thrd_exit_arm();
+	return rec;
+}
 
-	int res = func(thrd_arg);
-	thrd_exit(res);
+// Advances the epoch if every reader has seen the current one.
+static void _Rcu_try_advance(void)
+{
+	LONG epoch = ReadAcquire(&_Rcu_epoch);
+	_Rcu_fence();
+	LONG current = (epoch << 1) | 1;
+	for (_Rcu_record* rec = ReadPointerAcquire((PVOID volatile*)&_Rcu_records); rec; rec = rec->_Next)
+	{
+		LONG state = ReadAcquire(&rec->_State);
+		if (state && state != current) return;
+	}
+	InterlockedCompareExchange(&_Rcu_epoch, epoch + 1, epoch);
 }
 
-int __cdecl thrd_create(_Out_ thrd_t* thr, _In_ thrd_start_t func, _In_opt_ void* arg)
+static bool _Rcu_expired(LONG retired, LONG epoch)
 {
-	*thr = NULL;
-	_Thrd_start_arg* start_arg = malloc(sizeof(_Thrd_start_arg));
-	if (start_arg)
+	return epoch - retired >= 2;
+}
+
+// Frees the expired prefix of the entries, and returns how many were freed.
+// The entries should not be reachable by the destructors.
+static size_t _Rcu_free_expired(_In_reads_(count) _Rcu_entry* entries, size_t count, LONG epoch)
+{
+	size_t n = 0;
+	while (n < count && _Rcu_expired(entries[n]._Epoch, epoch))
 	{
-		start_arg->_Func = func;
-		start_arg->_Arg = arg;
-		*thr = (HANDLE)_beginthreadex(NULL, 0, _Thrd_start, start_arg, 0, NULL);
+		entries[n]._Dtor(entries[n]._Ptr);
+		n++;
 	}
-	if (!*thr)
+	return n;
+}
+
+static void _Rcu_collect(void)
+{
+	// The outer collect frees the expired ones retired meanwhile.
+	if (_Rcu_collecting) return;
+	_Rcu_collecting = true;
+	LONG epoch = ReadAcquire(&_Rcu_epoch);
+	// The destructors may retire pointers and grow the limbo list,
+	// thus the expired ones are moved out before they run.
+	_Rcu_entry expired[_RCU_BATCH];
+	for (;;)
 	{
-		// If it failed to create, the start_arg should be freed here
-		if (start_arg)
-			free(start_arg);
-		if (errno == EACCES)
-			return thrd_nomem;
+		size_t n = 0;
+		while (n < _Rcu_limbo_count && n < _RCU_BATCH && _Rcu_expired(_Rcu_limbo[n]._Epoch, epoch))
+			n++;
+		if (!n) break;
+		memcpy(expired, _Rcu_limbo, n * sizeof(_Rcu_entry));
+		_Rcu_limbo_count -= n;
+		memmove(_Rcu_limbo, _Rcu_limbo + n, _Rcu_limbo_count * sizeof(_Rcu_entry));
+		_Rcu_free_expired(expired, n, epoch);
+	}
+	_Rcu_limbo_next_scan = _Rcu_limbo_count + _RCU_BATCH;
+	if (ReadPointerNoFence((PVOID volatile*)&_Rcu_orphans))
+	{
+		// Take all orphans, and run the destructors without the lock.
+		_Mtx_word_lock(&_Rcu_lock);
+		_Rcu_orphan* orphans = _Rcu_orphans;
+		_Rcu_orphans = NULL;
+		_Mtx_word_unlock(&_Rcu_lock);
+		_Rcu_orphan* kept = NULL;
+		_Rcu_orphan** tail = &kept;
+		while (orphans)
+		{
+			_Rcu_orphan* orphan = orphans;
+			orphans = orphan->_Next;
+			size_t freed = _Rcu_free_expired(orphan->_Entries + orphan->_Begin, orphan->_Count, epoch);
+			orphan->_Begin += freed;
+			orphan->_Count -= freed;
+			if (orphan->_Count)
+			{
+				*tail = orphan;
+				tail = &orphan->_Next;
+			}
+			else
+			{
+				free(orphan->_Entries);
+				free(orphan);
+			}
+		}
+		if (kept)
+		{
+			_Mtx_word_lock(&_Rcu_lock);
+			*tail = _Rcu_orphans;
+			_Rcu_orphans = kept;
+			_Mtx_word_unlock(&_Rcu_lock);
+		}
+	}
+	_Rcu_collecting = false;
+}
+
+// Leaves the reclamation when the thread exits,
+// handing the limbo list to the other threads.
+static void _Rcu_exit(void)
+{
+	_Rcu_record* rec = _Rcu_self;
+	if (!rec) return;
+	WriteRelease(&rec->_State, 0);
+	_Rcu_depth = 0;
+	_Rcu_collect();
+	if (_Rcu_limbo_count)
+	{
+		_Rcu_orphan* orphan = malloc(sizeof(_Rcu_orphan));
+		if (orphan)
+		{
+			orphan->_Entries = _Rcu_limbo;
+			orphan->_Begin = 0;
+			orphan->_Count = _Rcu_limbo_count;
+			_Mtx_word_lock(&_Rcu_lock);
+			orphan->_Next = _Rcu_orphans;
+			_Rcu_orphans = orphan;
+			_Mtx_word_unlock(&_Rcu_lock);
+			_Rcu_limbo = NULL;
+		}
 		else
-			return thrd_error;
+		{
+			// Wait for the grace period here instead.
+			thrd_rcu_synchronize();
+		}
+	}
+	free(_Rcu_limbo);
+	_Rcu_limbo = NULL;
+	_Rcu_limbo_count = 0;
+	_Rcu_limbo_capacity = 0;
+	_Rcu_limbo_next_scan = _RCU_BATCH;
+	_Rcu_self = NULL;
+	InterlockedExchange(&rec->_Used, 0);
+}
+
+void __cdecl thrd_rcu_read_lock(void)
+{
+	if (_Rcu_depth++) return;
+	_Rcu_record* rec = _Rcu_self;
+	if (!rec) rec = _Rcu_register();
+	// Without a record the grace periods cannot see us,
+	// which only happens when out of memory at the first use.
+	assert(rec);
+	if (!rec) return;
+	WriteNoFence(&rec->_State, (ReadNoFence(&_Rcu_epoch) << 1) | 1);
+	// Ordered against the writers by _Rcu_fence.
+	_ReadWriteBarrier();
+}
+
+void __cdecl thrd_rcu_read_unlock(void)
+{
+	assert(_Rcu_depth);
+	if (--_Rcu_depth) return;
+	_Rcu_record* rec = _Rcu_self;
+	if (rec) WriteRelease(&rec->_State, 0);
+}
+
+int __cdecl thrd_rcu_retire(_In_opt_ void* ptr, _In_ thrd_rcu_dtor_t dtor)
+{
+	if (!ptr) return thrd_success;
+	if (!_Rcu_register()) return thrd_nomem;
+	if (_Rcu_limbo_count == _Rcu_limbo_capacity)
+	{
+		size_t capacity = _Rcu_limbo_capacity ? _Rcu_limbo_capacity * 2 : _RCU_BATCH;
+		_Rcu_entry* limbo = realloc(_Rcu_limbo, capacity * sizeof(_Rcu_entry));
+		if (!limbo)
+		{
+			// Free it synchronously, if not in a read-side critical section.
+			if (_Rcu_depth) return thrd_nomem;
+			thrd_rcu_synchronize();
+			dtor(ptr);
+			return thrd_success;
+		}
+		_Rcu_limbo = limbo;
+		_Rcu_limbo_capacity = capacity;
+	}
+	_Rcu_entry* entry = &_Rcu_limbo[_Rcu_limbo_count++];
+	entry->_Ptr = ptr;
+	entry->_Dtor = dtor;
+	entry->_Epoch = ReadAcquire(&_Rcu_epoch);
+	// Detect the grace periods once per batch.
+	if (_Rcu_limbo_count >= _Rcu_limbo_next_scan && !_Rcu_collecting)
+	{
+		_Rcu_try_advance();
+		_Rcu_collect();
+	}
+	return thrd_success;
+}
+
+void __cdecl thrd_rcu_synchronize(void)
+{
+	// Waiting inside a read-side critical section never ends.
+	assert(!_Rcu_depth);
+	LONG target = ReadAcquire(&_Rcu_epoch) + 2;
+	for (int i = 0; ReadAcquire(&_Rcu_epoch) - target < 0; i++)
+	{
+		_Rcu_try_advance();
+		if (ReadAcquire(&_Rcu_epoch) - target >= 0) break;
+		// Back off from yielding to sleeping.
+		if (i < 16)
+			SwitchToThread();
+		else
+			Sleep(1);
+	}
+	_Rcu_collect();
+}
+
+// Contention profiler
+
+// The call site of the public function
+#ifdef _MSC_VER
+#define _Prof_site() _ReturnAddress()
+#else
+#define _Prof_site() __builtin_return_address(0)
+#endif // _MSC_VER
+
+// Entries of the table of each thread, a power of 2
+#define _PROF_TABLE_SIZE 128
+// Locks held by a thread at once, for the hold times
+#define _PROF_HELD_DEPTH 16
+
+typedef struct _Prof_table
+{
+	struct _Prof_table* _Next;
+	// The generation of resets, stale if not the current one
+	LONG _Gen;
+	// Keyed by the objects with linear probing
+	thrd_prof_stats_t _Entries[_PROF_TABLE_SIZE];
+} _Prof_table;
+
+typedef struct
+{
+	const void* _Object;
+	LONGLONG _Since;
+} _Prof_held;
+
+typedef struct
+{
+	const void* _Object;
+	char* _Name;
+} _Prof_name;
+
+static volatile LONG _Prof_enabled = 0;
+static volatile LONG _Prof_gen = 0;
+// Guards the list of tables, the retired table and the names.
+static volatile LONG _Prof_lock = _WORD_UNLOCKED;
+static _Prof_table* _Prof_tables = NULL;
+// The tables of exited threads, merged
+static _Prof_table* _Prof_retired = NULL;
+static _Prof_name* _Prof_names = NULL;
+static size_t _Prof_names_count = 0;
+static size_t _Prof_names_capacity = 0;
+
+static thread_local _Prof_table* _Prof_self = NULL;
+static thread_local _Prof_held _Prof_held_locks[_PROF_HELD_DEPTH];
+static thread_local int _Prof_held_count = 0;
+
+#define _Prof_on() (ReadNoFence(&_Prof_enabled) != 0)
+
+static int _Prof_bucket(ULONGLONG ns)
+{
+	unsigned long index;
+	int bucket = 0;
+	if (ns >> 32)
+	{
+		_BitScanReverse(&index, (unsigned long)(ns >> 32));
+		bucket = (int)index + 33;
+	}
+	else if (_BitScanReverse(&index, (unsigned long)ns))
+	{
+		bucket = (int)index + 1;
+	}
+	return bucket < THRD_PROF_BUCKETS ? bucket : THRD_PROF_BUCKETS - 1;
+}
+
+// Counts the site, and replaces the least counted one if there is no room,
+// so that the heavy sites are kept approximately.
+static void _Prof_count_site(thrd_prof_site_t* sites, void* site, unsigned long long count)
+{
+	thrd_prof_site_t* least = &sites[0];
+	for (int i = 0; i < THRD_PROF_SITES; i++)
+	{
+		if (sites[i].site == site)
+		{
+			sites[i].count += count;
+			return;
+		}
+		if (sites[i].count < least->count) least = &sites[i];
+	}
+	least->site = site;
+	least->count += count;
+}
+
+// Finds the entry of the object, or inserts one.
+// Returns NULL if not found, or the table is full.
+static thrd_prof_stats_t* _Prof_find(_In_ _Prof_table* table, const void* object, bool insert)
+{
+	size_t index = (size_t)(((ULONGLONG)(uintptr_t)object * 0x9E3779B97F4A7C15ull) >> 32);
+	for (size_t i = 0; i < _PROF_TABLE_SIZE; i++)
+	{
+		thrd_prof_stats_t* entry = &table->_Entries[(index + i) & (_PROF_TABLE_SIZE - 1)];
+		// Read by the snapshots concurrently.
+		const void* current = ReadPointerAcquire((PVOID volatile*)&entry->object);
+		if (current == object) return entry;
+		if (!current)
+		{
+			if (!insert) return NULL;
+			WritePointerRelease((PVOID volatile*)&entry->object, (PVOID)object);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void _Prof_merge(_Inout_ thrd_prof_stats_t* dest, _In_ const thrd_prof_stats_t* src)
+{
+	dest->kind = src->kind;
+	dest->acquired += src->acquired;
+	dest->contended += src->contended;
+	dest->wait_ns += src->wait_ns;
+	dest->hold_ns += src->hold_ns;
+	for (int i = 0; i < THRD_PROF_BUCKETS; i++)
+	{
+		dest->wait_hist[i] += src->wait_hist[i];
+		dest->hold_hist[i] += src->hold_hist[i];
+	}
+	for (int i = 0; i < THRD_PROF_SITES; i++)
+	{
+		if (src->sites[i].count) _Prof_count_site(dest->sites, src->sites[i].site, src->sites[i].count);
+	}
+}
+
+// Gets the table of the calling thread, creating or clearing it as needed.
+static _Prof_table* _Prof_table_self(void)
+{
+	_Prof_table* table = _Prof_self;
+	LONG gen = ReadNoFence(&_Prof_gen);
+	if (table && table->_Gen == gen) return table;
+	if (!table)
+	{
+		table = calloc(1, sizeof(_Prof_table));
+		if (!table) return NULL;
+		table->_Gen = gen;
+		_Mtx_word_lock(&_Prof_lock);
+		table->_Next = _Prof_tables;
+		_Prof_tables = table;
+		_Mtx_word_unlock(&_Prof_lock);
+		_Prof_self = table;
+		// Merged into the retired table when the thread exits.
+		_Thrd_exit_arm();
+		return table;
+	}
+	// Reset since the last record, and not read in the middle of clearing.
+	_Mtx_word_lock(&_Prof_lock);
+	memset(table->_Entries, 0, sizeof(table->_Entries));
+	table->_Gen = gen;
+	_Mtx_word_unlock(&_Prof_lock);
+	return table;
+}
+
+// Records an acquisition, which waited since begin if it is not zero.
+static void _Prof_record(const void* object, int kind, LONGLONG begin, LONGLONG now, void* site)
+{
+	_Prof_table* table = _Prof_table_self();
+	if (!table) return;
+	thrd_prof_stats_t* entry = _Prof_find(table, object, true);
+	if (!entry) return;
+	entry->kind = kind;
+	entry->acquired++;
+	if (begin)
+	{
+		ULONGLONG ns = _Ticks_ns(now - begin);
+		entry->contended++;
+		entry->wait_ns += ns;
+		entry->wait_hist[_Prof_bucket(ns)]++;
+		_Prof_count_site(entry->sites, site, 1);
+	}
+	else
+	{
+		entry->wait_hist[0]++;
+	}
+}
+
+// Records a wait of a condition variable or a semaphore.
+static void _Prof_waited(const void* object, int kind, LONGLONG begin, void* site)
+{
+	_Prof_record(object, kind, begin, begin ? _Ticks_now() : 0, site);
+}
+
+// Records the acquisition of a lock, and begins its hold time.
+static void _Prof_acquired(const void* object, int kind, LONGLONG begin, void* site)
+{
+	LONGLONG now = _Ticks_now();
+	_Prof_record(object, kind, begin, now, site);
+	if (_Prof_held_count == _PROF_HELD_DEPTH)
+	{
+		// Forget the oldest, which may have been unlocked by an inline fast path.
+		memmove(_Prof_held_locks, _Prof_held_locks + 1, (_PROF_HELD_DEPTH - 1) * sizeof(_Prof_held));
+		_Prof_held_count--;
+	}
+	_Prof_held_locks[_Prof_held_count]._Object = object;
+	_Prof_held_locks[_Prof_held_count]._Since = now;
+	_Prof_held_count++;
+}
+
+// Records the hold time of the lock about to be unlocked.
+static void _Prof_released(const void* object)
+{
+	for (int i = _Prof_held_count - 1; i >= 0; i--)
+	{
+		if (_Prof_held_locks[i]._Object != object) continue;
+		ULONGLONG ns = _Ticks_ns(_Ticks_now() - _Prof_held_locks[i]._Since);
+		memmove(_Prof_held_locks + i, _Prof_held_locks + i + 1, (_Prof_held_count - i - 1) * sizeof(_Prof_held));
+		_Prof_held_count--;
+		_Prof_table* table = _Prof_table_self();
+		thrd_prof_stats_t* entry = table ? _Prof_find(table, object, false) : NULL;
+		if (entry)
+		{
+			entry->hold_ns += ns;
+			entry->hold_hist[_Prof_bucket(ns)]++;
+		}
+		return;
+	}
+}
+
+// Merges the table of the exiting thread into the retired one.
+static void _Prof_exit(void)
+{
+	_Prof_table* table = _Prof_self;
+	if (!table) return;
+	_Prof_self = NULL;
+	_Prof_held_count = 0;
+	_Mtx_word_lock(&_Prof_lock);
+	for (_Prof_table** p = &_Prof_tables; *p; p = &(*p)->_Next)
+	{
+		if (*p == table)
+		{
+			*p = table->_Next;
+			break;
+		}
+	}
+	if (table->_Gen == _Prof_gen)
+	{
+		if (!_Prof_retired)
+		{
+			_Prof_retired = calloc(1, sizeof(_Prof_table));
+			if (_Prof_retired) _Prof_retired->_Gen = _Prof_gen;
+		}
+		for (size_t i = 0; _Prof_retired && i < _PROF_TABLE_SIZE; i++)
+		{
+			thrd_prof_stats_t* src = &table->_Entries[i];
+			if (!src->object) continue;
+			thrd_prof_stats_t* dest = _Prof_find(_Prof_retired, src->object, true);
+			if (dest) _Prof_merge(dest, src);
+		}
+	}
+	_Mtx_word_unlock(&_Prof_lock);
+	free(table);
+}
+
+int __cdecl thrd_prof_enable(bool enable)
+{
+	if (enable) _Ticks_init();
+	WriteRelease(&_Prof_enabled, enable ? 1 : 0);
+	return thrd_success;
+}
+
+int __cdecl thrd_prof_register(_In_ const void* object, _In_z_ const char* name)
+{
+	size_t length = strlen(name) + 1;
+	char* copy = malloc(length);
+	if (!copy) return thrd_nomem;
+	memcpy(copy, name, length);
+	_Mtx_word_lock(&_Prof_lock);
+	for (size_t i = 0; i < _Prof_names_count; i++)
+	{
+		if (_Prof_names[i]._Object == object)
+		{
+			free(_Prof_names[i]._Name);
+			_Prof_names[i]._Name = copy;
+			_Mtx_word_unlock(&_Prof_lock);
+			return thrd_success;
+		}
+	}
+	if (_Prof_names_count == _Prof_names_capacity)
+	{
+		size_t capacity = _Prof_names_capacity ? _Prof_names_capacity * 2 : 16;
+		_Prof_name* names = realloc(_Prof_names, capacity * sizeof(_Prof_name));
+		if (!names)
+		{
+			_Mtx_word_unlock(&_Prof_lock);
+			free(copy);
+			return thrd_nomem;
+		}
+		_Prof_names = names;
+		_Prof_names_capacity = capacity;
+	}
+	_Prof_names[_Prof_names_count]._Object = object;
+	_Prof_names[_Prof_names_count]._Name = copy;
+	_Prof_names_count++;
+	_Mtx_word_unlock(&_Prof_lock);
+	return thrd_success;
+}
+
+void __cdecl thrd_prof_unregister(_In_ const void* object)
+{
+	_Mtx_word_lock(&_Prof_lock);
+	for (size_t i = 0; i < _Prof_names_count; i++)
+	{
+		if (_Prof_names[i]._Object == object)
+		{
+			free(_Prof_names[i]._Name);
+			_Prof_names[i] = _Prof_names[--_Prof_names_count];
+			break;
+		}
+	}
+	_Mtx_word_unlock(&_Prof_lock);
+}
+
+static int __cdecl _Prof_compare_object(const void* lhs, const void* rhs)
+{
+	uintptr_t l = (uintptr_t)((const thrd_prof_stats_t*)lhs)->object;
+	uintptr_t r = (uintptr_t)((const thrd_prof_stats_t*)rhs)->object;
+	return (l > r) - (l < r);
+}
+
+static int __cdecl _Prof_compare_wait(const void* lhs, const void* rhs)
+{
+	unsigned long long l = ((const thrd_prof_stats_t*)lhs)->wait_ns;
+	unsigned long long r = ((const thrd_prof_stats_t*)rhs)->wait_ns;
+	return (l < r) - (l > r);
+}
+
+// Merges all tables by the objects, sorted by the total waiting time.
+static int _Prof_collect(_Outptr_result_maybenull_ thrd_prof_stats_t** result, _Out_ size_t* count)
+{
+	*result = NULL;
+	*count = 0;
+	_Mtx_word_lock(&_Prof_lock);
+	LONG gen = _Prof_gen;
+	size_t tables = _Prof_retired ? 1 : 0;
+	for (_Prof_table* table = _Prof_tables; table; table = table->_Next) tables++;
+	thrd_prof_stats_t* all = malloc((tables ? tables : 1) * _PROF_TABLE_SIZE * sizeof(thrd_prof_stats_t));
+	if (!all)
+	{
+		_Mtx_word_unlock(&_Prof_lock);
+		return thrd_nomem;
+	}
+	size_t n = 0;
+	for (_Prof_table* table = _Prof_tables;; table = table->_Next)
+	{
+		_Prof_table* current = table ? table : _Prof_retired;
+		// The live tables are updated by their threads meanwhile,
+		// thus the counters may be a little behind.
+		if (current && current->_Gen == gen)
+		{
+			for (size_t i = 0; i < _PROF_TABLE_SIZE; i++)
+			{
+				if (!ReadPointerAcquire((PVOID volatile*)&current->_Entries[i].object)) continue;
+				all[n++] = current->_Entries[i];
+			}
+		}
+		if (!table) break;
+	}
+	qsort(all, n, sizeof(thrd_prof_stats_t), _Prof_compare_object);
+	size_t merged = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (merged && all[merged - 1].object == all[i].object)
+		{
+			_Prof_merge(&all[merged - 1], &all[i]);
+			continue;
+		}
+		all[merged] = all[i];
+		all[merged].name = NULL;
+		for (size_t j = 0; j < _Prof_names_count; j++)
+		{
+			if (_Prof_names[j]._Object == all[i].object) all[merged].name = _Prof_names[j]._Name;
+		}
+		merged++;
+	}
+	_Mtx_word_unlock(&_Prof_lock);
+	for (size_t i = 0; i < merged; i++)
+	{
+		// The most contended sites first
+		thrd_prof_site_t* sites = all[i].sites;
+		for (int j = 1; j < THRD_PROF_SITES; j++)
+		{
+			for (int k = j; k > 0 && sites[k].count > sites[k - 1].count; k--)
+			{
+				thrd_prof_site_t site = sites[k];
+				sites[k] = sites[k - 1];
+				sites[k - 1] = site;
+			}
+		}
+	}
+	qsort(all, merged, sizeof(thrd_prof_stats_t), _Prof_compare_wait);
+	*result = all;
+	*count = merged;
+	return thrd_success;
+}
+
+int __cdecl thrd_prof_snapshot(_Out_writes_(count) thrd_prof_stats_t* stats, size_t count, _Out_ size_t* total)
+{
+	thrd_prof_stats_t* all;
+	size_t n;
+	int r = _Prof_collect(&all, &n);
+	*total = n;
+	if (r) return r;
+	memcpy(stats, all, (n < count ? n : count) * sizeof(thrd_prof_stats_t));
+	free(all);
+	return thrd_success;
+}
+
+// The upper bound of the bucket at the quantile, in nanoseconds
+static unsigned long long _Prof_quantile(_In_ const unsigned long long* hist, double quantile)
+{
+	unsigned long long total = 0;
+	for (int i = 0; i < THRD_PROF_BUCKETS; i++) total += hist[i];
+	if (!total) return 0;
+	unsigned long long rank = (unsigned long long)((double)total * quantile);
+	unsigned long long seen = 0;
+	for (int i = 0; i < THRD_PROF_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if (seen > rank) return i ? 1ull << i : 0;
+	}
+	return 1ull << (THRD_PROF_BUCKETS - 1);
+}
+
+int __cdecl thrd_prof_report(_In_ FILE* stream)
+{
+	static const char* const kinds[] = { "mutex", "shared", "cond", "smph" };
+	thrd_prof_stats_t* all;
+	size_t n;
+	int r = _Prof_collect(&all, &n);
+	if (r) return r;
+	fprintf(stream, "%-24s %-6s %12s %12s %12s %12s %12s %12s\n", "object", "kind", "acquired", "contended", "wait ms", "hold ms", "p50 wait ns", "p99 wait ns");
+	for (size_t i = 0; i < n; i++)
+	{
+		thrd_prof_stats_t* s = &all[i];
+		char address[24];
+		if (!s->name) snprintf(address, sizeof(address), "%p", s->object);
+		fprintf(stream, "%-24s %-6s %12llu %12llu %12.3f %12.3f %12llu %12llu\n",
+			s->name ? s->name : address, kinds[s->kind & 3], s->acquired, s->contended,
+			(double)s->wait_ns / _NS_PER_MS, (double)s->hold_ns / _NS_PER_MS,
+			_Prof_quantile(s->wait_hist, 0.5), _Prof_quantile(s->wait_hist, 0.99));
+		for (int j = 0; j < THRD_PROF_SITES; j++)
+		{
+			if (s->sites[j].count) fprintf(stream, "    contended at %p: %llu\n", s->sites[j].site, s->sites[j].count);
+		}
+	}
+	free(all);
+	return thrd_success;
+}
+
+void __cdecl thrd_prof_reset(void)
+{
+	_Mtx_word_lock(&_Prof_lock);
+	// The live tables are cleared by their threads.
+	InterlockedIncrement(&_Prof_gen);
+	free(_Prof_retired);
+	_Prof_retired = NULL;
+	_Mtx_word_unlock(&_Prof_lock);
+}
+
+// Trace recorder
+
+// Types of the trace events
+enum
+{
+	_TRACE_THRD_CREATE,
+	_TRACE_THRD_START,
+	_TRACE_THRD_EXIT,
+	_TRACE_LOCK_WAIT,
+	_TRACE_LOCK_ACQUIRED,
+	_TRACE_LOCK_TIMEOUT,
+	_TRACE_CND_WAIT,
+	_TRACE_CND_WAKE,
+	_TRACE_CND_TIMEOUT,
+	_TRACE_CND_NOTIFY,
+	_TRACE_SMPH_WAIT,
+	_TRACE_SMPH_ACQUIRED,
+	_TRACE_SMPH_TIMEOUT,
+	_TRACE_SMPH_POST,
+	_TRACE_TSS_DTOR,
+	_TRACE_TSS_DTOR_END,
+};
+
+#ifdef WINCTHREADS_TRACE
+
+typedef struct
+{
+	LONGLONG _Ticks;
+	const void* _Object;
+	LONG _Type;
+} _Trace_event;
+
+typedef struct _Trace_buffer
+{
+	struct _Trace_buffer* _Next;
+	DWORD _Thread;
+	// The buffer is kept for the trace after the thread exits.
+	volatile LONG _Exited;
+	// The generation of clears, stale if not the current one
+	LONG _Gen;
+	// The events written, of which the last _Mask + 1 are kept.
+	volatile LONG64 _Count;
+	LONG64 _Mask;
+	// Followed by the events
+} _Trace_buffer;
+
+#define _Trace_events(buffer) ((_Trace_event*)((buffer) + 1))
+
+static volatile LONG _Trace_enabled = 0;
+static volatile LONG _Trace_gen = 0;
+static LONG64 _Trace_capacity = 0;
+// Guards the list of buffers.
+static volatile LONG _Trace_lock = _WORD_UNLOCKED;
+static _Trace_buffer* _Trace_buffers = NULL;
+
+static thread_local _Trace_buffer* _Trace_self = NULL;
+
+#define _Trace_on() (ReadNoFence(&_Trace_enabled) != 0)
+#define _Trace(type, object) (_Trace_on() ? _Trace_record((type), (object)) : (void)0)
+
+// Gets the buffer of the calling thread, creating or clearing it as needed.
+static _Trace_buffer* _Trace_buffer_self(void)
+{
+	_Trace_buffer* buffer = _Trace_self;
+	LONG gen = ReadNoFence(&_Trace_gen);
+	if (buffer && buffer->_Gen == gen) return buffer;
+	if (!buffer)
+	{
+		LONG64 capacity = ReadNoFence64(&_Trace_capacity);
+		buffer = malloc(sizeof(_Trace_buffer) + (size_t)capacity * sizeof(_Trace_event));
+		if (!buffer) return NULL;
+		buffer->_Thread = GetCurrentThreadId();
+		buffer->_Exited = 0;
+		buffer->_Mask = capacity - 1;
+		buffer->_Count = 0;
+		buffer->_Gen = gen;
+		_Mtx_word_lock(&_Trace_lock);
+		buffer->_Next = _Trace_buffers;
+		_Trace_buffers = buffer;
+		_Mtx_word_unlock(&_Trace_lock);
+		_Trace_self = buffer;
+		return buffer;
+	}
+	// Cleared since the last event, and not written out in the middle.
+	_Mtx_word_lock(&_Trace_lock);
+	buffer->_Count = 0;
+	buffer->_Gen = gen;
+	_Mtx_word_unlock(&_Trace_lock);
+	return buffer;
+}
+
+static void _Trace_record(LONG type, const void* object)
+{
+	_Trace_buffer* buffer = _Trace_buffer_self();
+	if (!buffer) return;
+	LONG64 count = buffer->_Count;
+	_Trace_event* e = &_Trace_events(buffer)[count & buffer->_Mask];
+	e->_Ticks = _Ticks_now();
+	e->_Object = object;
+	e->_Type = type;
+	WriteRelease64(&buffer->_Count, count + 1);
+}
+
+// Detaches the buffer from the exiting thread.
+static void _Trace_exit(void)
+{
+	_Trace_buffer* buffer = _Trace_self;
+	if (!buffer) return;
+	_Trace_self = NULL;
+	WriteRelease(&buffer->_Exited, 1);
+}
+
+#else
+
+#define _Trace_on() false
+#define _Trace(type, object) ((void)0)
+#define _Trace_exit() ((void)0)
+
+#endif // WINCTHREADS_TRACE
+
+int __cdecl thrd_trace_start(size_t capacity)
+{
+#ifdef WINCTHREADS_TRACE
+	if (!capacity || capacity > ((size_t)1 << 24)) return thrd_error;
+	LONG64 size = 1;
+	while ((size_t)size < capacity) size <<= 1;
+	_Ticks_init();
+	// Only the buffers created later take the new capacity.
+	WriteNoFence64(&_Trace_capacity, size);
+	WriteRelease(&_Trace_enabled, 1);
+	return thrd_success;
+#else
+	(void)capacity;
+	return thrd_error;
+#endif // WINCTHREADS_TRACE
+}
+
+int __cdecl thrd_trace_stop(void)
+{
+#ifdef WINCTHREADS_TRACE
+	WriteRelease(&_Trace_enabled, 0);
+	return thrd_success;
+#else
+	return thrd_error;
+#endif // WINCTHREADS_TRACE
+}
+
+#ifdef WINCTHREADS_TRACE
+// The names and phases of the event types in the trace event format,
+// and the extra arguments of the waits that end without the object
+static const struct
+{
+	const char* _Name;
+	char _Phase;
+	const char* _Args;
+} _Trace_formats[] = {
+	{ "thrd_create", 'i', "" },
+	{ "thread", 'B', "" },
+	{ "thread", 'E', "" },
+	{ "lock wait", 'B', "" },
+	{ "lock wait", 'E', "" },
+	{ "lock wait", 'E', ",\"result\":\"timedout\"" },
+	{ "cnd wait", 'B', "" },
+	{ "cnd wait", 'E', "" },
+	{ "cnd wait", 'E', ",\"result\":\"timedout\"" },
+	{ "cnd notify", 'i', "" },
+	{ "smph wait", 'B', "" },
+	{ "smph wait", 'E', "" },
+	{ "smph wait", 'E', ",\"result\":\"timedout\"" },
+	{ "smph post", 'i', "" },
+	{ "tss dtor", 'B', "" },
+	{ "tss dtor", 'E', "" },
+};
+#endif // WINCTHREADS_TRACE
+
+int __cdecl thrd_trace_write(_In_ FILE* stream)
+{
+#ifdef WINCTHREADS_TRACE
+	DWORD pid = GetCurrentProcessId();
+	bool first = true;
+	fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	_Mtx_word_lock(&_Trace_lock);
+	LONG gen = _Trace_gen;
+	for (_Trace_buffer* buffer = _Trace_buffers; buffer; buffer = buffer->_Next)
+	{
+		if (buffer->_Gen != gen) continue;
+		fprintf(stream, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"thread %lu\"}}",
+			first ? "" : ",", (unsigned long)pid, (unsigned long)buffer->_Thread, (unsigned long)buffer->_Thread);
+		first = false;
+		// The running threads may overwrite the oldest events meanwhile.
+		LONG64 end = ReadAcquire64(&buffer->_Count);
+		LONG64 begin = end > buffer->_Mask + 1 ? end - buffer->_Mask - 1 : 0;
+		for (LONG64 i = begin; i < end; i++)
+		{
+			const _Trace_event* e = &_Trace_events(buffer)[i & buffer->_Mask];
+			if ((size_t)e->_Type >= sizeof(_Trace_formats) / sizeof(_Trace_formats[0])) continue;
+			// Microseconds, as the format requires.
+			double ts = (double)_Ticks_ns(e->_Ticks) / 1000.0;
+			fprintf(stream, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu,%s\"args\":{\"object\":\"%p\"%s}}",
+				_Trace_formats[e->_Type]._Name, _Trace_formats[e->_Type]._Phase, ts, (unsigned long)pid, (unsigned long)buffer->_Thread,
+				_Trace_formats[e->_Type]._Phase == 'i' ? "\"s\":\"t\"," : "", e->_Object,
+				_Trace_formats[e->_Type]._Args);
+		}
+	}
+	_Mtx_word_unlock(&_Trace_lock);
+	fprintf(stream, "\n]}\n");
+	return thrd_success;
+#else
+	(void)stream;
+	return thrd_error;
+#endif // WINCTHREADS_TRACE
+}
+
+void __cdecl thrd_trace_clear(void)
+{
+#ifdef WINCTHREADS_TRACE
+	_Mtx_word_lock(&_Trace_lock);
+	// The live buffers are cleared by their threads.
+	InterlockedIncrement(&_Trace_gen);
+	for (_Trace_buffer** p = &_Trace_buffers; *p;)
+	{
+		_Trace_buffer* buffer = *p;
+		if (ReadAcquire(&buffer->_Exited))
+		{
+			*p = buffer->_Next;
+			free(buffer);
+		}
+		else
+		{
+			p = &buffer->_Next;
+		}
+	}
+	_Mtx_word_unlock(&_Trace_lock);
+#endif // WINCTHREADS_TRACE
+}
+
+// The registry of all keys
+typedef struct
+{
+	tss_dtor_t _Dtor;
+	// Bumped when the key is deleted, so that the values set
+	// with the old key are invalidated in all threads.
+	DWORD _Gen;
+	// Index + 1 of the next free entry
+	DWORD _Next_free;
+} _Tss_key_entry;
+
+static volatile LONG _Tss_keys_lock = _WORD_UNLOCKED;
+static _Tss_key_entry* _Tss_keys = NULL;
+static DWORD _Tss_keys_capacity = 0;
+static DWORD _Tss_keys_count = 0;
+static DWORD _Tss_free_head = 0;
+
+// Not static, for the inline tss_get of the static library.
+thread_local _Tss_slot* _Tss_slots = NULL;
+thread_local DWORD _Tss_slots_capacity = 0;
+// The indices of the slots with values, so that the destructors
+// need not scan the whole table
+static thread_local DWORD* _Tss_used = NULL;
+static thread_local DWORD _Tss_used_count = 0;
+static thread_local DWORD _Tss_used_capacity = 0;
+
+#define _Tss_index(key) ((DWORD)(key))
+#define _Tss_gen(key) ((DWORD)((key) >> 32))
+
+// Removes the slot from the list of the slots with values.
+static void _Tss_unlist(DWORD index)
+{
+	DWORD pos = _Tss_slots[index]._Pos - 1;
+	DWORD last = _Tss_used[--_Tss_used_count];
+	_Tss_used[pos] = last;
+	_Tss_slots[last]._Pos = pos + 1;
+	_Tss_slots[index]._Pos = 0;
+}
+
+// Values whose destructors are looked up under one lock
+#define _TSS_DTOR_BATCH 64
+
+typedef struct
+{
+	tss_dtor_t _Dtor;
+	void* _Value;
+} _Tss_dtor_call;
+
+// Clear all remained data TSS_DTOR_ITERATIONS times,
+// And free the slots of this thread
+static void _Tss_clear_all(void)
+{
+	_Tss_dtor_call calls[_TSS_DTOR_BATCH];
+	bool again = true;
+	for (int i = 0; i < TSS_DTOR_ITERATIONS && again; i++)
+	{
+		again = false;
+		// Destructors may set values again and change the list,
+		// so it is indexed freshly after every batch.
+		DWORD pos = 0;
+		while (pos < _Tss_used_count)
+		{
+			int count = 0;
+			_Mtx_word_lock(&_Tss_keys_lock);
+			while (pos < _Tss_used_count && count < _TSS_DTOR_BATCH)
+			{
+				DWORD index = _Tss_used[pos];
+				_Tss_slot* slot = &_Tss_slots[index];
+				tss_dtor_t dtor = NULL;
+				// The values of deleted keys are left alone.
+				if (index < _Tss_keys_count && _Tss_keys[index]._Gen == slot->_Gen)
+					dtor = _Tss_keys[index]._Dtor;
+				if (!dtor)
+				{
+					pos++;
+					continue;
+				}
+				calls[count]._Dtor = dtor;
+				calls[count]._Value = slot->_Value;
+				count++;
+				slot->_Value = NULL;
+				// The last one is moved here.
+				_Tss_unlist(index);
+			}
+			_Mtx_word_unlock(&_Tss_keys_lock);
+			for (int j = 0; j < count; j++)
+			{
+				_Trace(_TRACE_TSS_DTOR, calls[j]._Value);
+				calls[j]._Dtor(calls[j]._Value);
+				_Trace(_TRACE_TSS_DTOR_END, calls[j]._Value);
+			}
+			if (count) again = true;
+		}
+	}
+	free(_Tss_slots);
+	_Tss_slots = NULL;
+	_Tss_slots_capacity = 0;
+	free(_Tss_used);
+	_Tss_used = NULL;
+	_Tss_used_count = 0;
+	_Tss_used_capacity = 0;
+	// Destructors may have locked.
+	_Prof_exit();
+	// Destructors may have retired pointers.
+	_Rcu_exit();
+}
+
+// The alignment of arena allocations, enough for any type
+#define _ARENA_ALIGN 16
+// The size of a usual arena block, larger ones are made for large allocations
+#define _ARENA_BLOCK_SIZE 65536
+
+// A block of the arena, followed by its memory
+typedef struct _Arena_block
+{
+	struct _Arena_block* _Prev;
+	size_t _Size;
+	size_t _Used;
+} _Arena_block;
+
+#define _ARENA_HEADER ((sizeof(_Arena_block) + _ARENA_ALIGN - 1) & ~(size_t)(_ARENA_ALIGN - 1))
+
+// The newest block of the calling thread
+static thread_local _Arena_block* _Arena_top = NULL;
+
+// Frees the blocks newer than the block, or all blocks if it is NULL.
+static void _Arena_free_until(_In_opt_ _Arena_block* block)
+{
+	_Arena_block* top = _Arena_top;
+	while (top && top != block)
+	{
+		_Arena_block* prev = top->_Prev;
+		free(top);
+		top = prev;
+	}
+	_Arena_top = top;
+}
+
+void* __cdecl thrd_arena_alloc(size_t size)
+{
+	if (size > SIZE_MAX - _ARENA_HEADER - _ARENA_ALIGN) return NULL;
+	size = (size + _ARENA_ALIGN - 1) & ~(size_t)(_ARENA_ALIGN - 1);
+	if (!size) size = _ARENA_ALIGN;
+	_Arena_block* top = _Arena_top;
+	if (!top || top->_Size - top->_Used < size)
+	{
+		size_t block_size = size > _ARENA_BLOCK_SIZE ? size : _ARENA_BLOCK_SIZE;
+		_Arena_block* block = malloc(_ARENA_HEADER + block_size);
+		if (!block) return NULL;
+		block->_Prev = top;
+		block->_Size = block_size;
+		block->_Used = 0;
+		_Arena_top = top = block;
+	}
+	void* p = (char*)top + _ARENA_HEADER + top->_Used;
+	top->_Used += size;
+	return p;
+}
+
+void __cdecl thrd_arena_reset(void)
+{
+	_Arena_block* first = _Arena_top;
+	if (!first) return;
+	while (first->_Prev) first = first->_Prev;
+	_Arena_free_until(first);
+	first->_Used = 0;
+}
+
+void __cdecl thrd_arena_mark(_Out_ thrd_arena_mark_t* mark)
+{
+	_Arena_block* top = _Arena_top;
+	mark->block = top;
+	mark->used = top ? top->_Used : 0;
+}
+
+void __cdecl thrd_arena_rewind(_In_ const thrd_arena_mark_t* mark)
+{
+	_Arena_free_until(mark->block);
+	if (_Arena_top) _Arena_top->_Used = mark->used;
+}
+
+
+// States of a thread object
+// Running a function, and it may be joined or detached
+#define _THRD_RUNNING 0
+// Running a function, and it has been detached
+#define _THRD_DETACHED 1
+// Finished, and the OS thread is exiting
+#define _THRD_EXITED 2
+// Finished, and the OS thread is parked for the cache
+#define _THRD_PARKED 3
+// Parked in the cache, waiting for a new function
+#define _THRD_CACHED 4
+// Parked, but it should exit
+#define _THRD_QUIT 5
+
+#ifdef _WIN32
+typedef HANDLE _Thrd_handle_t;
+#else
+// An address on Linux, thus never 0 for a created thread.
+typedef pthread_t _Thrd_handle_t;
+#endif // _WIN32
+
+// States of the settings of a thread
+// Created without settings, and it may be cached
+#define _THRD_SETUP_NONE 0
+// The thread applies the rest of the settings itself before the function
+#define _THRD_SETUP_PENDING 1
+#define _THRD_SETUP_APPLIED 2
+// The thread exits without running the function
+#define _THRD_SETUP_FAILED 3
+
+struct _Thrd_obj
+{
+	// 0 if the thread is not created by the library
+	_Thrd_handle_t _Handle;
+	// The start function and its argument, carried inline
+	thrd_start_t _Func;
+	void* _Arg;
+	int _Res;
+	// Also the address where joiners and parked threads wait
+	volatile LONG _State;
+	// One of _THRD_SETUP_*, also the address where the creator waits
+	volatile LONG _Setup;
+	// The settings, only used while creating
+	const thrd_attr_t* _Attr;
+	struct _Thrd_obj* _Next;
+};
+
+// The thread object of the calling thread
+static thread_local struct _Thrd_obj* _Thrd_self = NULL;
+// The thread object of threads not created by the library
+static thread_local struct _Thrd_obj _Thrd_foreign;
+
+// The cache of parked threads
+static volatile LONG _Thrd_cache_lock = _WORD_UNLOCKED;
+static struct _Thrd_obj* _Thrd_cache_head = NULL;
+// Count of parked and cached threads
+static LONG _Thrd_cache_count = 0;
+static LONG _Thrd_cache_limit = 0;
+
+// Reserves a place in the cache for a finishing thread
+static bool _Thrd_cache_reserve(void)
+{
+	if (!ReadNoFence(&_Thrd_cache_limit)) return false;
+	_Mtx_word_lock(&_Thrd_cache_lock);
+	bool reserved = _Thrd_cache_count < _Thrd_cache_limit;
+	if (reserved) _Thrd_cache_count++;
+	_Mtx_word_unlock(&_Thrd_cache_lock);
+	return reserved;
+}
+
+// Puts a parked thread into the cache after it is joined or detached,
+// or lets it quit if the limit has been lowered.
+static void _Thrd_cache_put(_In_ struct _Thrd_obj* obj)
+{
+	_Mtx_word_lock(&_Thrd_cache_lock);
+	bool quit = _Thrd_cache_count > _Thrd_cache_limit;
+	if (quit)
+	{
+		_Thrd_cache_count--;
+		_Mtx_word_unlock(&_Thrd_cache_lock);
+		WriteRelease(&obj->_State, _THRD_QUIT);
+		_Atomic_notify_all(&obj->_State);
+		return;
+	}
+	obj->_Next = _Thrd_cache_head;
+	_Thrd_cache_head = obj;
+	WriteRelease(&obj->_State, _THRD_CACHED);
+	_Mtx_word_unlock(&_Thrd_cache_lock);
+}
+
+static struct _Thrd_obj* _Thrd_cache_get(void)
+{
+	if (!ReadPointerNoFence((PVOID volatile*)&_Thrd_cache_head)) return NULL;
+	_Mtx_word_lock(&_Thrd_cache_lock);
+	struct _Thrd_obj* obj = _Thrd_cache_head;
+	if (obj)
+	{
+		_Thrd_cache_head = obj->_Next;
+		_Thrd_cache_count--;
+	}
+	_Mtx_word_unlock(&_Thrd_cache_lock);
+	return obj;
+}
+
+// Thread objects are allocated in chunks, and recycled through a free list.
+// The chunks are never freed, so that waking a stale object is harmless.
+#define _THRD_OBJS_PER_CHUNK 64
+
+static volatile LONG _Thrd_objs_lock = _WORD_UNLOCKED;
+static struct _Thrd_obj* _Thrd_objs_free = NULL;
+
+static struct _Thrd_obj* _Thrd_obj_alloc(void)
+{
+	_Mtx_word_lock(&_Thrd_objs_lock);
+	struct _Thrd_obj* obj = _Thrd_objs_free;
+	if (!obj)
+	{
+		struct _Thrd_obj* chunk = malloc(_THRD_OBJS_PER_CHUNK * sizeof(struct _Thrd_obj));
+		if (chunk)
+		{
+			for (int i = 0; i < _THRD_OBJS_PER_CHUNK - 1; i++)
+				chunk[i]._Next = &chunk[i + 1];
+			chunk[_THRD_OBJS_PER_CHUNK - 1]._Next = NULL;
+			obj = chunk;
+		}
+	}
+	if (obj) _Thrd_objs_free = obj->_Next;
+	_Mtx_word_unlock(&_Thrd_objs_lock);
+	return obj;
+}
+
+static void _Thrd_obj_release(_In_ struct _Thrd_obj* obj)
+{
+	_Mtx_word_lock(&_Thrd_objs_lock);
+	obj->_Next = _Thrd_objs_free;
+	_Thrd_objs_free = obj;
+	_Mtx_word_unlock(&_Thrd_objs_lock);
+}
+
+// Releases the object of an exiting thread.
+static void _Thrd_free(_In_ struct _Thrd_obj* obj)
+{
+#ifdef _WIN32
+	BOOL r = CloseHandle(obj->_Handle);
+#else
+	// The OS thread releases itself when it exits.
+	bool r = !pthread_detach(obj->_Handle);
+#endif // _WIN32
+	assert(r);
+	(void)r;
+	_Thrd_obj_release(obj);
+}
+
+// Finishes the current function of the thread with res.
+// Returns true if the thread has got a new function from thrd_create,
+// or false if the thread should exit.
+static bool _Thrd_finish(_In_ struct _Thrd_obj* self, int res, bool park)
+{
+	self->_Res = res;
+	if (park) park = _Thrd_cache_reserve();
+	LONG done = park ? _THRD_PARKED : _THRD_EXITED;
+	if (InterlockedCompareExchange(&self->_State, done, _THRD_RUNNING) == _THRD_RUNNING)
+	{
+		// The joiner may have freed the object when exited,
+		// but waking a stale address is harmless.
+		_Atomic_notify_all(&self->_State);
+		if (!park) return false;
+	}
+	else
+	{
+		// It has been detached, and no one will join it.
+		if (!park)
+		{
+			_Thrd_free(self);
+			return false;
+		}
+		_Thrd_cache_put(self);
+	}
+	LONG state;
+	while ((state = ReadAcquire(&self->_State)) == _THRD_PARKED || state == _THRD_CACHED)
+		_Atomic_wait(&self->_State, state, _NO_DEADLINE);
+	// The new function may have been detached before we wake.
+	if (state != _THRD_QUIT) return true;
+	_Thrd_free(self);
+	return false;
+}
+
+int __cdecl thrd_attr_init(_Out_ thrd_attr_t* attr)
+{
+	*attr = (thrd_attr_t)THRD_ATTR_INITIALIZER;
+	return thrd_success;
+}
+
+static bool _Thrd_attr_default(_In_opt_ const thrd_attr_t* attr)
+{
+	return !attr || (!attr->stack_size && !attr->guard_size && !attr->affinity && attr->numa_node < 0 && attr->priority == thrd_priority_normal && !attr->name);
+}
+
+#ifdef _WIN32
+// Applies the settings to the suspended thread.
+static bool _Thrd_attr_apply(HANDLE handle, _In_ const thrd_attr_t* attr)
+{
+	if (attr->affinity || attr->numa_node >= 0)
+	{
+		GROUP_AFFINITY affinity;
+		ZeroMemory(&affinity, sizeof(affinity));
+		if (attr->numa_node >= 0)
+		{
+			if (!GetNumaNodeProcessorMaskEx((USHORT)attr->numa_node, &affinity)) return false;
+			if (attr->affinity)
+			{
+				if (affinity.Group != attr->group) return false;
+				affinity.Mask &= (KAFFINITY)attr->affinity;
+			}
+		}
+		else
+		{
+			affinity.Group = attr->group;
+			affinity.Mask = (KAFFINITY)attr->affinity;
+		}
+		if (!affinity.Mask || !SetThreadGroupAffinity(handle, &affinity, NULL)) return false;
+	}
+	if (attr->priority != thrd_priority_normal && !SetThreadPriority(handle, attr->priority)) return false;
+	if (attr->name)
+	{
+		int length = MultiByteToWideChar(CP_UTF8, 0, attr->name, -1, NULL, 0);
+		if (!length) return false;
+		WCHAR* name = malloc(length * sizeof(WCHAR));
+		if (!name) return false;
+		MultiByteToWideChar(CP_UTF8, 0, attr->name, -1, name, length);
+		HRESULT hr = SetThreadDescription(handle, name);
+		free(name);
+		if (FAILED(hr)) return false;
+	}
+	return true;
+}
+#else
+// Nice values between 2 adjacent priorities
+#define _THRD_NICE_PER_PRIORITY 5
+
+// Gets the CPUs of the settings, and returns false if there is none.
+static bool _Thrd_attr_cpus(_In_ const thrd_attr_t* attr, _Out_ cpu_set_t* cpus)
+{
+	CPU_ZERO(cpus);
+	if (attr->numa_node >= 0)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", attr->numa_node);
+		FILE* file = fopen(path, "r");
+		if (!file) return false;
+		// Ranges like "0-3,8-11"
+		char list[1024];
+		bool read = fgets(list, sizeof(list), file) != NULL;
+		fclose(file);
+		if (!read) return false;
+		char* p = list;
+		for (;;)
+		{
+			char* end;
+			long first = strtol(p, &end, 10), last = first;
+			if (end == p) break;
+			if (*end == '-') last = strtol(end + 1, &end, 10);
+			for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+				CPU_SET((int)cpu, cpus);
+			if (*end != ',') break;
+			p = end + 1;
+		}
+	}
+	if (attr->affinity)
+	{
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		for (int i = 0; i < 64; i++)
+		{
+			int cpu = attr->group * 64 + i;
+			if ((attr->affinity >> i & 1) && cpu < CPU_SETSIZE) CPU_SET(cpu, &mask);
+		}
+		if (attr->numa_node >= 0)
+			CPU_AND(cpus, cpus, &mask);
+		else
+			*cpus = mask;
+	}
+	return CPU_COUNT(cpus) > 0;
+}
+
+// Applies the settings which only the thread itself can.
+static bool _Thrd_attr_apply_self(_In_ const thrd_attr_t* attr)
+{
+	if (attr->priority != thrd_priority_normal)
+	{
+		// A thread has its own nice value on Linux, inherited from the creator.
+		id_t tid = (id_t)GetCurrentThreadId();
+		errno = 0;
+		int nice = getpriority(PRIO_PROCESS, tid);
+		if (nice == -1 && errno) return false;
+		nice -= attr->priority * _THRD_NICE_PER_PRIORITY;
+		if (nice < -20) nice = -20;
+		if (nice > 19) nice = 19;
+		if (setpriority(PRIO_PROCESS, tid, nice)) return false;
+	}
+	if (attr->name)
+	{
+		// Linux keeps 15 bytes.
+		char name[16];
+		size_t length = strlen(attr->name);
+		if (length >= sizeof(name)) length = sizeof(name) - 1;
+		memcpy(name, attr->name, length);
+		name[length] = '\0';
+		if (pthread_setname_np(pthread_self(), name)) return false;
+	}
+	return true;
+}
+#endif // _WIN32
+
+// Called first by a thread with settings.
+// Returns false if the function should not run.
+static bool _Thrd_setup(_In_ struct _Thrd_obj* self)
+{
+#ifdef _WIN32
+	// The creator has applied them before resuming the thread.
+	return ReadAcquire(&self->_Setup) != _THRD_SETUP_FAILED;
+#else
+	if (ReadAcquire(&self->_Setup) != _THRD_SETUP_PENDING) return true;
+	bool applied = _Thrd_attr_apply_self(self->_Attr);
+	WriteRelease(&self->_Setup, applied ? _THRD_SETUP_APPLIED : _THRD_SETUP_FAILED);
+	_Atomic_notify_all(&self->_Setup);
+	return applied;
+#endif // _WIN32
+}
+
+// Promise that all data will be destructed by calling thrd_exit,
+// or before the thread is reused.
+#ifdef _WIN32
+static unsigned WINAPI _Thrd_start(void* arg)
+#else
+static void* _Thrd_start(void* arg)
+#endif // _WIN32
+{
+	struct _Thrd_obj* self = arg;
+	if (self->_Setup && !_Thrd_setup(self))
+	{
+#ifdef _WIN32
+		return 0;
+#else
+		return NULL;
+#endif // _WIN32
+	}
+	_Thrd_self = self;
+	int res;
+	do
+	{
+		_Trace(_TRACE_THRD_START, self);
+		res = self->_Func(self->_Arg);
+		_Tss_clear_all();
+		_Trace(_TRACE_THRD_EXIT, self);
+		// The next function starts with an empty arena.
+		thrd_arena_reset();
+	} while (_Thrd_finish(self, res, !self->_Setup));
+	_Arena_free_until(NULL);
+	_Thrd_timer_close();
+	_Trace_exit();
+#ifdef _WIN32
+	return (unsigned)res;
+#else
+	return NULL;
+#endif // _WIN32
+}
+
+int __cdecl thrd_create(_Out_ thrd_t* thr, _In_ thrd_start_t func, _In_opt_ void* arg)
+{
+	return thrd_create_ex(thr, func, arg, NULL);
+}
+
+int __cdecl thrd_create_ex(_Out_ thrd_t* thr, _In_ thrd_start_t func, _In_opt_ void* arg, _In_opt_ const thrd_attr_t* attr)
+{
+	*thr = NULL;
+	if (_Thrd_attr_default(attr))
+	{
+		attr = NULL;
+		struct _Thrd_obj* obj = _Thrd_cache_get();
+		if (obj)
+		{
+			// Wake a parked thread with the new function.
+			obj->_Func = func;
+			obj->_Arg = arg;
+			obj->_Res = 0;
+			_Trace(_TRACE_THRD_CREATE, obj);
+			WriteRelease(&obj->_State, _THRD_RUNNING);
+			_Atomic_notify_all(&obj->_State);
+			*thr = obj;
+			return thrd_success;
+		}
+	}
+	else if (attr->priority < thrd_priority_lowest || attr->priority > thrd_priority_highest)
+	{
+		return thrd_error;
+	}
+	struct _Thrd_obj* obj = _Thrd_obj_alloc();
+	if (!obj) return thrd_nomem;
+	obj->_Func = func;
+	obj->_Arg = arg;
+	obj->_Res = 0;
+	obj->_State = _THRD_RUNNING;
+	obj->_Setup = attr ? _THRD_SETUP_APPLIED : _THRD_SETUP_NONE;
+	obj->_Attr = attr;
+	obj->_Next = NULL;
+	_Trace(_TRACE_THRD_CREATE, obj);
+	// The handle is only used after the thread is joined or detached,
+	// thus it is safe to set it after the thread starts.
+#ifdef _WIN32
+	unsigned stack_size = 0, flags = 0;
+	if (attr)
+	{
+		if (attr->stack_size > UINT_MAX)
+		{
+			_Thrd_obj_release(obj);
+			return thrd_error;
+		}
+		stack_size = (unsigned)attr->stack_size;
+		// Apply the settings before the thread runs.
+		flags = CREATE_SUSPENDED | (stack_size ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0);
+	}
+	obj->_Handle = (HANDLE)_beginthreadex(NULL, stack_size, _Thrd_start, obj, flags, NULL);
+	if (!obj->_Handle)
+	{
+		// If it failed to create, the object should be freed here
+		_Thrd_obj_release(obj);
+		if (errno == EACCES)
+			return thrd_nomem;
+		else
+			return thrd_error;
+	}
+	if (attr)
+	{
+		bool applied = _Thrd_attr_apply(obj->_Handle, attr);
+		if (!applied) obj->_Setup = _THRD_SETUP_FAILED;
+		ResumeThread(obj->_Handle);
+		if (!applied)
+		{
+			WaitForSingleObject(obj->_Handle, INFINITE);
+			_Thrd_free(obj);
+			return thrd_error;
+		}
+	}
+#else
+	pthread_attr_t pattr;
+	if (attr)
+	{
+		if (pthread_attr_init(&pattr))
+		{
+			_Thrd_obj_release(obj);
+			return thrd_nomem;
+		}
+		bool valid = true;
+		if (attr->stack_size) valid = !pthread_attr_setstacksize(&pattr, attr->stack_size);
+		if (valid && attr->guard_size) valid = !pthread_attr_setguardsize(&pattr, attr->guard_size);
+		if (valid && (attr->affinity || attr->numa_node >= 0))
+		{
+			cpu_set_t cpus;
+			valid = _Thrd_attr_cpus(attr, &cpus) && !pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus);
+		}
+		if (!valid)
+		{
+			pthread_attr_destroy(&pattr);
+			_Thrd_obj_release(obj);
+			return thrd_error;
+		}
+		// The others are applied by the thread itself.
+		if (attr->priority != thrd_priority_normal || attr->name)
+			obj->_Setup = _THRD_SETUP_PENDING;
+	}
+	int r = pthread_create(&obj->_Handle, attr ? &pattr : NULL, _Thrd_start, obj);
+	if (attr) pthread_attr_destroy(&pattr);
+	if (r)
+	{
+		_Thrd_obj_release(obj);
+		return r == EAGAIN ? thrd_nomem : thrd_error;
+	}
+	LONG setup;
+	while ((setup = ReadAcquire(&obj->_Setup)) == _THRD_SETUP_PENDING)
+		_Atomic_wait(&obj->_Setup, setup, _NO_DEADLINE);
+	if (setup == _THRD_SETUP_FAILED)
+	{
+		pthread_join(obj->_Handle, NULL);
+		_Thrd_obj_release(obj);
+		return thrd_error;
+	}
+#endif // _WIN32
+	*thr = obj;
+	return thrd_success;
+}
+
+int __cdecl thrd_equal(_In_ thrd_t lhs, _In_ thrd_t rhs)
+{
+	return lhs == rhs;
+}
+
+#ifdef _WIN32
+static bool _Thrd_is_own(void)
+{
+	return _Thrd_self && _Thrd_self->_Handle;
+}
+#endif // _WIN32
+
+// The threads not created by the library clean up in a destructor of the system,
+// which is armed when they first keep something of their own.
+static thread_local bool _Thrd_exit_armed = false;
+static once_flag _Thrd_exit_once = ONCE_FLAG_INIT;
+#ifdef _WIN32
+static DWORD _Thrd_exit_index = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t _Thrd_exit_key;
+static bool _Thrd_exit_key_valid = false;
+#endif // _WIN32
+
+static void _Thrd_exit_hook(void)
+{
+	// Armed again if anything is kept while cleaning up.
+	_Thrd_exit_armed = false;
+	// Also leaves the reclamation.
+	_Tss_clear_all();
+}
+
+#ifdef _WIN32
+static void WINAPI _Thrd_exit_callback(PVOID value)
+#else
+static void _Thrd_exit_callback(void* value)
+#endif // _WIN32
+{
+	(void)value;
+	_Thrd_exit_hook();
+}
+
+static void __cdecl _Thrd_exit_init(void)
+{
+#ifdef _WIN32
+	_Thrd_exit_index = FlsAlloc(_Thrd_exit_callback);
+#else
+	_Thrd_exit_key_valid = !pthread_key_create(&_Thrd_exit_key, _Thrd_exit_callback);
+#endif // _WIN32
+}
+
+static void _Thrd_exit_arm(void)
+{
+	if (_Thrd_exit_armed) return;
+	// The threads of the library clean up in _Thrd_start and thrd_exit.
+	if (_Thrd_self && _Thrd_self->_Handle) return;
+	_Thrd_exit_armed = true;
+	call_once(&_Thrd_exit_once, _Thrd_exit_init);
+#ifdef _WIN32
+	if (_Thrd_exit_index != FLS_OUT_OF_INDEXES) FlsSetValue(_Thrd_exit_index, (PVOID)1);
+#else
+	if (_Thrd_exit_key_valid) pthread_setspecific(_Thrd_exit_key, (void*)1);
+#endif // _WIN32
+}
+
+thrd_t __cdecl thrd_current(void)
+{
+	struct _Thrd_obj* self = _Thrd_self;
+	if (!self) self = _Thrd_self = &_Thrd_foreign;
+	return self;
+}
+
+// Sleeps until the monotonic deadline.
+// Returns 0 if succeeded, -1 if interrupted, and -2 if failed.
+static int _Thrd_sleep_until(LONGLONG deadline)
+{
+	LONGLONG span;
+	while ((span = deadline - _Mono_now()) > 0)
+	{
+		if (span < _WAIT_SPIN_NS)
+		{
+			SwitchToThread();
+			continue;
+		}
+#ifdef _WIN32
+		DWORD r = _Thrd_timer_sleep(span, TRUE);
+		if (r == WAIT_ABANDONED) r = SleepEx(_Deadline_ms(deadline), TRUE);
+		if (r == WAIT_IO_COMPLETION) return -1;
+		if (r) return -2;
+#else
+		struct timespec abs_time;
+		_Timespec_from_ns(&abs_time, deadline);
+		int r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs_time, NULL);
+		if (r == EINTR) return -1;
+		if (r) return -2;
+#endif // _WIN32
+	}
+	return 0;
+}
+
+int __cdecl thrd_sleep(_In_ const struct timespec* duration, struct timespec* remaining)
+{
+	LONGLONG now = _Mono_now();
+	LONGLONG span = _Timespec_ns(duration);
+	LONGLONG deadline = span >= _NO_DEADLINE - now ? _NO_DEADLINE : now + span;
+	int r = _Thrd_sleep_until(deadline);
+	if (r == -1 && remaining)
+	{
+		span = deadline - _Mono_now();
+		_Timespec_from_ns(remaining, span > 0 ? span : 0);
+	}
+	return r;
+}
+
+int __cdecl _Thrd_clocksleep(int base, _In_ const struct timespec* time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, base, &deadline)) return -2;
+	return _Thrd_sleep_until(deadline);
+}
+
+void __cdecl thrd_yield(void)
+{
+#ifdef _WIN32
+	Sleep(0);
+#else
+	sched_yield();
+#endif // _WIN32
+}
+
+noreturn void __cdecl thrd_exit(_In_ int res)
+{
+	// Clear all data before exit
+	_Tss_clear_all();
+	_Trace(_TRACE_THRD_EXIT, _Thrd_self);
+	_Trace_exit();
+	_Arena_free_until(NULL);
+	// The thread is not reused because its stack cannot be unwound.
+	struct _Thrd_obj* self = _Thrd_self;
+	if (self && self->_Handle) _Thrd_finish(self, res, false);
+	_Thrd_timer_close();
+#ifdef _WIN32
+	_endthreadex((unsigned)res);
+#else
+	pthread_exit(NULL);
+#endif // _WIN32
+}
+
+int __cdecl thrd_detach(_In_ thrd_t thr)
+{
+	// Nothing to release for the threads not created by the library.
+	if (!thr->_Handle) return thrd_success;
+	switch (InterlockedCompareExchange(&thr->_State, _THRD_DETACHED, _THRD_RUNNING))
+	{
+	case _THRD_RUNNING:
+		// The thread releases itself when finished.
+		break;
+	case _THRD_EXITED:
+		_Thrd_free(thr);
+		break;
+	case _THRD_PARKED:
+		_Thrd_cache_put(thr);
+		break;
+	default:
+		return thrd_error;
+	}
+	return thrd_success;
+}
+
+int __cdecl thrd_join(_In_ thrd_t thr, int* res)
+{
+	if (!thr->_Handle) return thrd_error;
+	LONG state;
+	while ((state = ReadAcquire(&thr->_State)) == _THRD_RUNNING)
+		_Atomic_wait(&thr->_State, state, _NO_DEADLINE);
+	if (state != _THRD_EXITED && state != _THRD_PARKED)
+		return thrd_error;
+	if (res) *res = thr->_Res;
+	if (state == _THRD_PARKED)
+	{
+		_Thrd_cache_put(thr);
+	}
+	else
+	{
+		// Wait for the exit, so that the object is not used any more.
+#ifdef _WIN32
+		if (WaitForSingleObject(thr->_Handle, INFINITE) == WAIT_FAILED)
+			return thrd_error;
+		_Thrd_free(thr);
+#else
+		if (pthread_join(thr->_Handle, NULL))
+			return thrd_error;
+		_Thrd_obj_release(thr);
+#endif // _WIN32
+	}
+	return thrd_success;
+}
+
+int __cdecl thrd_set_cache_limit(int limit)
+{
+	if (limit < 0) return thrd_error;
+	struct _Thrd_obj* quit = NULL;
+	_Mtx_word_lock(&_Thrd_cache_lock);
+	WriteNoFence(&_Thrd_cache_limit, limit);
+	// Parked threads not in the cache quit when they are joined.
+	while (_Thrd_cache_count > limit && _Thrd_cache_head)
+	{
+		struct _Thrd_obj* obj = _Thrd_cache_head;
+		_Thrd_cache_head = obj->_Next;
+		_Thrd_cache_count--;
+		obj->_Next = quit;
+		quit = obj;
+	}
+	_Mtx_word_unlock(&_Thrd_cache_lock);
+	while (quit)
+	{
+		struct _Thrd_obj* next = quit->_Next;
+		WriteRelease(&quit->_State, _THRD_QUIT);
+		_Atomic_notify_all(&quit->_State);
+		quit = next;
+	}
+	return thrd_success;
+}
+
+// States of a waiter of a condition variable
+// In the queue of the condition variable
+#define _CND_QUEUED 0
+// Moved to the mutex by cnd_broadcast
+#define _CND_MORPHED 1
+// Woken by cnd_signal or cnd_broadcast
+#define _CND_SIGNALED 2
+// Woken by the unlocking owner of the mutex after morphed
+#define _CND_HANDED 3
+
+// A waiter lives on the stack of the waiting thread,
+// and it is never touched by others after it is woken.
+struct _Cnd_waiter
+{
+	// Also the address where the waiter parks
+	volatile LONG _State;
+	struct _Cnd_waiter* _Prev;
+	struct _Cnd_waiter* _Next;
+};
+
+// A counter of readers, alone in its cache line
+typedef struct _Mtx_reader_slot
+{
+	volatile LONG _Count;
+	char _Pad[_CACHE_LINE - sizeof(LONG)];
+} _Mtx_reader_slot;
+
+// The reader slots of a distributed shared mutex.
+// Writers are serialized by the lock word of the mutex,
+// and they always have priority over new readers.
+struct _Mtx_readers
+{
+	// Nonzero while a writer holds or drains the slots
+	volatile LONG _Writer;
+	// Nonzero while a reader is upgrading; the other writers back off
+	// before entering, so that it gets the lock word next.
+	volatile LONG _Upgrader;
+	ULONG _Mask;
+	char _Pad[_CACHE_LINE - 2 * sizeof(LONG) - sizeof(ULONG)];
+	_Mtx_reader_slot _Slots[1];
+};
+
+// The hash of the calling thread id, 0 if not computed yet
+static thread_local ULONG _Mtx_reader_hash = 0;
+
+// Gets the slot of the calling thread.
+// A thread always uses the same slot, so the counts never go negative.
+static _Mtx_reader_slot* _Mtx_reader_slot_of(_In_ struct _Mtx_readers* readers)
+{
+	ULONG hash = _Mtx_reader_hash;
+	if (!hash)
+	{
+		// Fibonacci hashing spreads the sequential ids.
+		hash = (((ULONG)GetCurrentThreadId() * 0x9E3779B1u) >> 16) | 0x10000;
+		_Mtx_reader_hash = hash;
+	}
+	return &readers->_Slots[hash & readers->_Mask];
+}
+
+static struct _Mtx_readers* _Mtx_readers_create(void)
+{
+	ULONG count = (ULONG)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	// A power of 2, not less than the processors.
+	ULONG slots = 1;
+	while (slots < count && slots < 0x10000) slots <<= 1;
+	struct _Mtx_readers* readers = malloc(sizeof(struct _Mtx_readers) + (slots - 1) * sizeof(_Mtx_reader_slot));
+	if (!readers) return NULL;
+	readers->_Writer = 0;
+	readers->_Upgrader = 0;
+	readers->_Mask = slots - 1;
+	for (ULONG i = 0; i < slots; i++)
+		readers->_Slots[i]._Count = 0;
+	return readers;
+}
+
+static bool _Mtx_distributed_tryslock(_In_ struct _Mtx_readers* readers, _In_ _Mtx_reader_slot* slot)
+{
+	InterlockedIncrement(&slot->_Count);
+	// The increment is a full barrier against the writer,
+	// who raises the flag before reading the slots.
+	if (!ReadAcquire(&readers->_Writer)) return true;
+	// Back off, and wake the writer draining this slot.
+	if (!InterlockedDecrement(&slot->_Count))
+		_Atomic_notify_all(&slot->_Count);
+	return false;
+}
+
+static void _Mtx_distributed_slock(_In_ struct _Mtx_readers* readers)
+{
+	_Mtx_reader_slot* slot = _Mtx_reader_slot_of(readers);
+	while (!_Mtx_distributed_tryslock(readers, slot))
+		_Atomic_wait(&readers->_Writer, 1, _NO_DEADLINE);
+}
+
+static void _Mtx_distributed_sunlock(_In_ struct _Mtx_readers* readers)
+{
+	_Mtx_reader_slot* slot = _Mtx_reader_slot_of(readers);
+	if (!InterlockedDecrement(&slot->_Count) && ReadAcquire(&readers->_Writer))
+		_Atomic_notify_all(&slot->_Count);
+}
+
+// Lowers the flag, and wakes the readers waiting for it.
+static void _Mtx_distributed_lower(_In_ struct _Mtx_readers* readers)
+{
+	InterlockedExchange(&readers->_Writer, 0);
+	_Atomic_notify_all(&readers->_Writer);
+}
+
+// Raises the flag and waits for the readers to leave,
+// with the lock word held.
+// Returns false with the flag lowered if a reader is upgrading, unless it is the caller.
+static bool _Mtx_distributed_drain(_In_ struct _Mtx_readers* readers, bool upgrading)
+{
+	InterlockedExchange(&readers->_Writer, 1);
+	for (ULONG i = 0; i <= readers->_Mask; i++)
+	{
+		volatile LONG* count = &readers->_Slots[i]._Count;
+		LONG c;
+		while ((c = ReadAcquire(count)) != 0)
+			_Atomic_wait(count, c, _NO_DEADLINE);
+	}
+	// The upgrader raises its flag before leaving its slot.
+	if (upgrading || !ReadAcquire(&readers->_Upgrader)) return true;
+	_Mtx_distributed_lower(readers);
+	return false;
+}
+
+// Returns false if any slot is in use or a reader is upgrading,
+// with the flag lowered again.
+static bool _Mtx_distributed_trydrain(_In_ struct _Mtx_readers* readers, bool upgrading)
+{
+	InterlockedExchange(&readers->_Writer, 1);
+	for (ULONG i = 0; i <= readers->_Mask; i++)
+	{
+		if (ReadAcquire(&readers->_Slots[i]._Count))
+		{
+			_Mtx_distributed_lower(readers);
+			return false;
+		}
+	}
+	if (upgrading || !ReadAcquire(&readers->_Upgrader)) return true;
+	_Mtx_distributed_lower(readers);
+	return false;
+}
+
+static void _Mtx_distributed_lock(_In_ mtx_t* mutex)
+{
+	struct _Mtx_readers* readers = mutex->readers;
+	for (;;)
+	{
+		_Mtx_word_lock(&mutex->obj.rw.lock);
+		if (_Mtx_distributed_drain(readers, false)) return;
+		// Let the upgrader take the lock word.
+		_Mtx_word_unlock(&mutex->obj.rw.lock);
+		LONG upgrader;
+		while ((upgrader = ReadAcquire(&readers->_Upgrader)) != 0)
+			_Atomic_wait(&readers->_Upgrader, upgrader, _NO_DEADLINE);
+	}
+}
+
+static void _Mtx_distributed_unlock(_In_ mtx_t* mutex)
+{
+	_Mtx_distributed_lower(mutex->readers);
+	_Mtx_word_unlock(&mutex->obj.rw.lock);
+}
+
+static void _Mtx_distributed_upgraded(_In_ struct _Mtx_readers* readers)
+{
+	InterlockedExchange(&readers->_Upgrader, 0);
+	_Atomic_notify_all(&readers->_Upgrader);
+}
+
+static int _Mtx_distributed_upgrade(_In_ mtx_t* mutex, bool wait)
+{
+	struct _Mtx_readers* readers = mutex->readers;
+	if (InterlockedCompareExchange(&readers->_Upgrader, 1, 0)) return thrd_busy;
+	if (wait)
+	{
+		// Leave the slot, so that a writer draining it finishes, sees the flag and backs off.
+		// No writer enters before us, and the other readers are drained again.
+		_Mtx_distributed_sunlock(readers);
+		_Mtx_word_lock(&mutex->obj.rw.lock);
+		_Mtx_distributed_drain(readers, true);
+		_Mtx_distributed_upgraded(readers);
+		return thrd_success;
+	}
+	if (!_Mtx_word_trylock(&mutex->obj.rw.lock))
+	{
+		_Mtx_distributed_upgraded(readers);
+		return thrd_busy;
+	}
+	_Mtx_reader_slot* slot = _Mtx_reader_slot_of(readers);
+	InterlockedDecrement(&slot->_Count);
+	bool drained = _Mtx_distributed_trydrain(readers, true);
+	// The flag is lowered if failed, and no writer can come in without the lock word.
+	if (!drained) InterlockedIncrement(&slot->_Count);
+	_Mtx_distributed_upgraded(readers);
+	if (drained) return thrd_success;
+	_Mtx_word_unlock(&mutex->obj.rw.lock);
+	return thrd_busy;
+}
+
+static void _Mtx_distributed_downgrade(_In_ mtx_t* mutex)
+{
+	InterlockedIncrement(&_Mtx_reader_slot_of(mutex->readers)->_Count);
+	_Mtx_distributed_unlock(mutex);
+}
+
+// The state of a shared mutex.
+// The low bits count the readers inside.
+#define _RW_READERS 0x00FFFFFF
+// A writer is inside.
+#define _RW_WRITER 0x01000000
+// The writer inside came from an upgrade, and it does not hold the lock word.
+#define _RW_UPGRADED 0x02000000
+// The writer holding the lock word waits for the readers to leave.
+#define _RW_PENDING 0x04000000
+// A reader waits for the other readers to leave, to upgrade.
+#define _RW_UPGRADING 0x08000000
+// The readers who waited for the last writer enter before the next one,
+// until all of them have entered.
+#define _RW_BATCH 0x10000000
+
+#define _RW_POLICY(type) (((type) >> 4) & 0x3)
+
+// Whether a new reader may enter in the state
+static bool _Rw_can_read(_In_ mtx_t* mutex, LONG state)
+{
+	if (state & (_RW_WRITER | _RW_UPGRADING)) return false;
+	switch (mutex->policy)
+	{
+	case _RW_POLICY(_Mtx_prefer_readers):
+		return true;
+	case _RW_POLICY(_Mtx_prefer_writers):
+		return !(state & _RW_PENDING);
+	default:
+		return !(state & _RW_PENDING) || (state & _RW_BATCH);
+	}
+}
+
+// Whether the writer holding the lock word may enter in the state
+static bool _Rw_can_write(_In_ mtx_t* mutex, LONG state)
+{
+	if (state & (_RW_READERS | _RW_WRITER | _RW_UPGRADING)) return false;
+	return mutex->policy != _RW_POLICY(_Mtx_phase_fair) || !(state & _RW_BATCH);
+}
+
+static bool _Rw_tryslock(_In_ mtx_t* mutex)
+{
+	LONG state = ReadAcquire(&mutex->obj.rw.state);
+	while (_Rw_can_read(mutex, state))
+	{
+		LONG prev = InterlockedCompareExchange(&mutex->obj.rw.state, state + 1, state);
+		if (prev == state) return true;
+		state = prev;
+	}
+	return false;
+}
+
+static void _Rw_slock(_In_ mtx_t* mutex)
+{
+	if (_Rw_tryslock(mutex)) return;
+	// Counted before checking again, so that the writer leaving sees us.
+	InterlockedIncrement(&mutex->obj.rw.waiting);
+	for (;;)
+	{
+		LONG state = ReadAcquire(&mutex->obj.rw.state);
+		if (_Rw_can_read(mutex, state))
+		{
+			if (InterlockedCompareExchange(&mutex->obj.rw.state, state + 1, state) == state) break;
+		}
+		else
+		{
+			_Atomic_wait(&mutex->obj.rw.state, state, _NO_DEADLINE);
+		}
+	}
+	// The last reader of the batch lets the writers in again.
+	if (!InterlockedDecrement(&mutex->obj.rw.waiting) && (ReadAcquire(&mutex->obj.rw.state) & _RW_BATCH))
+	{
+		LONG state = InterlockedAnd(&mutex->obj.rw.state, ~_RW_BATCH);
+		if (state & _RW_PENDING) _Atomic_notify_all(&mutex->obj.rw.state);
+	}
+}
+
+static void _Rw_sunlock(_In_ mtx_t* mutex)
+{
+	LONG state = InterlockedDecrement(&mutex->obj.rw.state);
+	if (!(state & _RW_READERS) && (state & (_RW_PENDING | _RW_UPGRADING)))
+		_Atomic_notify_all(&mutex->obj.rw.state);
+}
+
+static void _Rw_lock(_In_ mtx_t* mutex)
+{
+	_Mtx_word_lock(&mutex->obj.rw.lock);
+	InterlockedOr(&mutex->obj.rw.state, _RW_PENDING);
+	for (;;)
+	{
+		LONG state = ReadAcquire(&mutex->obj.rw.state);
+		if (_Rw_can_write(mutex, state))
+		{
+			if (InterlockedCompareExchange(&mutex->obj.rw.state, (state & ~_RW_PENDING) | _RW_WRITER, state) == state) break;
+		}
+		else
+		{
+			_Atomic_wait(&mutex->obj.rw.state, state, _NO_DEADLINE);
+		}
+	}
+}
+
+static bool _Rw_trylock(_In_ mtx_t* mutex)
+{
+	if (!_Mtx_word_trylock(&mutex->obj.rw.lock)) return false;
+	LONG state = ReadAcquire(&mutex->obj.rw.state);
+	while (_Rw_can_write(mutex, state))
+	{
+		LONG prev = InterlockedCompareExchange(&mutex->obj.rw.state, state | _RW_WRITER, state);
+		if (prev == state) return true;
+		state = prev;
+	}
+	_Mtx_word_unlock(&mutex->obj.rw.lock);
+	return false;
+}
+
+// Lets the writer out, and the calling thread stays as a reader if readers is 1.
+static void _Rw_unlock(_In_ mtx_t* mutex, LONG readers)
+{
+	LONG state = ReadAcquire(&mutex->obj.rw.state);
+	LONG next;
+	for (;;)
+	{
+		next = (state & ~(_RW_WRITER | _RW_UPGRADED)) + readers;
+		// A phase of readers begins after each writer.
+		if (mutex->policy == _RW_POLICY(_Mtx_phase_fair) && ReadAcquire(&mutex->obj.rw.waiting))
+			next |= _RW_BATCH;
+		LONG prev = InterlockedCompareExchange(&mutex->obj.rw.state, next, state);
+		if (prev == state) break;
+		state = prev;
+	}
+	if (ReadAcquire(&mutex->obj.rw.waiting) || (next & _RW_PENDING))
+		_Atomic_notify_all(&mutex->obj.rw.state);
+	// An upgraded writer never took the lock word.
+	if (!(state & _RW_UPGRADED)) _Mtx_word_unlock(&mutex->obj.rw.lock);
+}
+
+static int _Rw_upgrade(_In_ mtx_t* mutex)
+{
+	LONG state = ReadAcquire(&mutex->obj.rw.state);
+	for (;;)
+	{
+		// Two upgrading readers would wait for each other forever.
+		if (state & _RW_UPGRADING) return thrd_busy;
+		// Leave as a reader, but keep the others out by the flag.
+		LONG prev = InterlockedCompareExchange(&mutex->obj.rw.state, (state - 1) | _RW_UPGRADING, state);
+		if (prev == state) break;
+		state = prev;
+	}
+	for (;;)
+	{
+		state = ReadAcquire(&mutex->obj.rw.state);
+		if (!(state & (_RW_READERS | _RW_WRITER)))
+		{
+			LONG next = (state & ~_RW_UPGRADING) | _RW_WRITER | _RW_UPGRADED;
+			if (InterlockedCompareExchange(&mutex->obj.rw.state, next, state) == state) break;
+		}
+		else
+		{
+			_Atomic_wait(&mutex->obj.rw.state, state, _NO_DEADLINE);
+		}
+	}
+	return thrd_success;
+}
+
+static int _Rw_tryupgrade(_In_ mtx_t* mutex)
+{
+	LONG state = ReadAcquire(&mutex->obj.rw.state);
+	while ((state & _RW_READERS) == 1 && !(state & _RW_UPGRADING))
+	{
+		LONG next = (state - 1) | _RW_WRITER | _RW_UPGRADED;
+		LONG prev = InterlockedCompareExchange(&mutex->obj.rw.state, next, state);
+		if (prev == state) return thrd_success;
+		state = prev;
+	}
+	return thrd_busy;
+}
+
+int __cdecl mtx_init(_Out_ mtx_t* mutex, _In_ int type)
+{
+	bool distributed = type & _Mtx_distributed;
+	int policy = _RW_POLICY(type);
+	if (policy == _RW_POLICY(_Mtx_prefer_readers | _Mtx_prefer_writers)) return thrd_error;
+	type &= mtx_timed | mtx_recursive;
+	mutex->policy = policy;
+	mutex->recursive = (type & mtx_recursive) != 0;
+	mutex->basetype = type & (~mtx_recursive);
+	mutex->owner = 0;
+	mutex->count = 0;
+	mutex->morphed = NULL;
+	mutex->readers = NULL;
+	if (mutex->basetype == _Mtx_shared)
+	{
+		mutex->obj.rw.lock = _WORD_UNLOCKED;
+		mutex->obj.rw.state = 0;
+		mutex->obj.rw.waiting = 0;
+		if (distributed)
+		{
+			// Writers always go first, so there is no policy to choose.
+			if (policy) return thrd_error;
+			mutex->readers = _Mtx_readers_create();
+			if (!mutex->readers) return thrd_nomem;
+		}
+	}
+	else
+	{
+		if (distributed || policy) return thrd_error;
+		mutex->obj.word = _WORD_UNLOCKED;
+	}
+	return thrd_success;
+}
+
+// If the calling thread owns the recursive mutex,
+// increases the recursion depth and returns true.
+static bool _Mtx_reenter(_In_ mtx_t* mutex)
+{
+	if (mutex->recursive && mutex->owner == GetCurrentThreadId())
+	{
+		mutex->count++;
+		return true;
+	}
+	return false;
+}
+
+static void _Mtx_set_owner(_In_ mtx_t* mutex)
+{
+	if (mutex->recursive)
+	{
+		mutex->owner = GetCurrentThreadId();
+		mutex->count = 1;
+	}
+}
+
+static int _Mtx_lock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->readers)
+	{
+		_Mtx_distributed_lock(mutex);
+		return thrd_success;
+	}
+	if (mutex->basetype == _Mtx_shared)
+	{
+		_Rw_lock(mutex);
+		return thrd_success;
+	}
+	if (_Mtx_reenter(mutex)) return thrd_success;
+	_Mtx_word_lock(&mutex->obj.word);
+	_Mtx_set_owner(mutex);
+	return thrd_success;
+}
+
+static int _Mtx_slock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers)
+		_Mtx_distributed_slock(mutex->readers);
+	else
+		_Rw_slock(mutex);
+	return thrd_success;
+}
+
+static int _Mtx_timedlock_impl(_In_ mtx_t* mutex, LONGLONG deadline)
+{
+	if (_Mtx_reenter(mutex)) return thrd_success;
+	int r = _Mtx_word_timedlock(&mutex->obj.word, deadline);
+	if (!r) _Mtx_set_owner(mutex);
+	return r;
+}
+
+static int _Mtx_trylock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->readers)
+	{
+		if (!_Mtx_word_trylock(&mutex->obj.rw.lock)) return thrd_busy;
+		if (_Mtx_distributed_trydrain(mutex->readers, false)) return thrd_success;
+		_Mtx_word_unlock(&mutex->obj.rw.lock);
+		return thrd_busy;
+	}
+	if (mutex->basetype == _Mtx_shared)
+	{
+		if (_Rw_trylock(mutex))
+			return thrd_success;
+		else
+			return thrd_busy;
+	}
+	if (_Mtx_reenter(mutex)) return thrd_success;
+	if (!_Mtx_word_trylock(&mutex->obj.word)) return thrd_busy;
+	_Mtx_set_owner(mutex);
+	return thrd_success;
+}
+
+static int _Mtx_tryslock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers)
+	{
+		if (_Mtx_distributed_tryslock(mutex->readers, _Mtx_reader_slot_of(mutex->readers)))
+			return thrd_success;
+		else
+			return thrd_busy;
+	}
+	if (_Rw_tryslock(mutex))
+		return thrd_success;
+	else
+		return thrd_busy;
+}
+
+// Hands the mutex to a morphed waiter, or unlocks it if there is none.
+// If released, the lock word has been unlocked, and is taken back only for a waiter.
+static void _Mtx_release_slow(_In_ mtx_t* mutex, bool released)
+{
+	for (;;)
+	{
+		if (released)
+		{
+			// A broadcast may have seen the word locked before we unlocked it.
+			if (!ReadPointerAcquire((PVOID volatile*)&mutex->morphed)) return;
+			if (InterlockedCompareExchange(&mutex->obj.word, _WORD_CONTENDED, _WORD_UNLOCKED) != _WORD_UNLOCKED) return;
+		}
+		// Only the owner pops the waiters, thus no ABA problem here.
+		struct _Cnd_waiter* waiter = ReadPointerAcquire((PVOID volatile*)&mutex->morphed);
+		while (waiter)
+		{
+			struct _Cnd_waiter* prev = InterlockedCompareExchangePointer((PVOID volatile*)&mutex->morphed, waiter->_Next, waiter);
+			if (prev == waiter) break;
+			waiter = prev;
+		}
+		InterlockedExchange(&mutex->obj.word, _WORD_UNLOCKED);
+		if (waiter)
+		{
+			// The waiter locks it as contended,
+			// so that its unlock continues to hand the mutex.
+			WriteRelease(&waiter->_State, _CND_HANDED);
+			_Atomic_notify_one(&waiter->_State);
+			return;
+		}
+		_Atomic_notify_one(&mutex->obj.word);
+		// The same race as above, with the list empty when we looked.
+		released = true;
+	}
+}
+
+// Unlocks the lock word of the mutex.
+// If there are morphed waiters, hands the mutex to one of them.
+static void _Mtx_release(_In_ mtx_t* mutex)
+{
+	_Mtx_release_slow(mutex, InterlockedCompareExchange(&mutex->obj.word, _WORD_UNLOCKED, _WORD_LOCKED) == _WORD_LOCKED);
+}
+
+int __cdecl _Mtx_lock_slow(_In_ mtx_t* mutex)
+{
+	return _Mtx_word_lock_slow(&mutex->obj.word, _NO_DEADLINE);
+}
+
+int __cdecl _Mtx_unlock_slow(_In_ mtx_t* mutex, bool released)
+{
+	_Mtx_release_slow(mutex, released);
+	return thrd_success;
+}
+
+static int _Mtx_unlock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->readers)
+	{
+		_Mtx_distributed_unlock(mutex);
+		return thrd_success;
+	}
+	if (mutex->basetype == _Mtx_shared)
+	{
+		_Rw_unlock(mutex, 0);
+		return thrd_success;
+	}
+	if (mutex->recursive)
+	{
+		if (mutex->owner != GetCurrentThreadId()) return thrd_error;
+		if (--mutex->count) return thrd_success;
+		mutex->owner = 0;
+	}
+	_Mtx_release(mutex);
+	return thrd_success;
+}
+
+static int _Mtx_sunlock_impl(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers)
+		_Mtx_distributed_sunlock(mutex->readers);
+	else
+		_Rw_sunlock(mutex);
+	return thrd_success;
+}
+
+// The public lock functions record the acquisitions when profiling.
+
+static int _Mtx_prof_kind(_In_ mtx_t* mutex)
+{
+	return mutex->basetype == _Mtx_shared ? thrd_prof_shared : thrd_prof_mutex;
+}
+
+static int _Mtx_lock_at(_In_ mtx_t* mutex, void* site)
+{
+	if (!_Prof_on() && !_Trace_on()) return _Mtx_lock_impl(mutex);
+	LONGLONG begin = 0;
+	if (_Mtx_trylock_impl(mutex))
+	{
+		begin = _Ticks_now();
+		_Trace(_TRACE_LOCK_WAIT, mutex);
+		_Mtx_lock_impl(mutex);
+		_Trace(_TRACE_LOCK_ACQUIRED, mutex);
+	}
+	if (_Prof_on()) _Prof_acquired(mutex, _Mtx_prof_kind(mutex), begin, site);
+	return thrd_success;
+}
+
+static int _Mtx_slock_at(_In_ mtx_t* mutex, void* site)
+{
+	if (!_Prof_on() && !_Trace_on()) return _Mtx_slock_impl(mutex);
+	LONGLONG begin = 0;
+	int r = _Mtx_tryslock_impl(mutex);
+	if (r == thrd_error) return r;
+	if (r)
+	{
+		begin = _Ticks_now();
+		_Trace(_TRACE_LOCK_WAIT, mutex);
+		_Mtx_slock_impl(mutex);
+		_Trace(_TRACE_LOCK_ACQUIRED, mutex);
+	}
+	if (_Prof_on()) _Prof_acquired(mutex, thrd_prof_shared, begin, site);
+	return thrd_success;
+}
+
+static int _Mtx_clocklock_at(_In_ mtx_t* restrict mutex, int base, _In_ const struct timespec* restrict time_point, void* site)
+{
+	if (mutex->basetype != mtx_timed) return thrd_error;
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, base, &deadline)) return thrd_error;
+	if (!_Prof_on() && !_Trace_on()) return _Mtx_timedlock_impl(mutex, deadline);
+	LONGLONG begin = 0;
+	if (_Mtx_trylock_impl(mutex))
+	{
+		begin = _Ticks_now();
+		_Trace(_TRACE_LOCK_WAIT, mutex);
+		int r = _Mtx_timedlock_impl(mutex, deadline);
+		_Trace(r ? _TRACE_LOCK_TIMEOUT : _TRACE_LOCK_ACQUIRED, mutex);
+		if (r) return r;
+	}
+	if (_Prof_on()) _Prof_acquired(mutex, thrd_prof_mutex, begin, site);
+	return thrd_success;
+}
+
+int __cdecl mtx_lock(_In_ mtx_t* mutex)
+{
+	return _Mtx_lock_at(mutex, _Prof_site());
+}
+
+int __cdecl _Mtx_slock(_In_ mtx_t* mutex)
+{
+	return _Mtx_slock_at(mutex, _Prof_site());
+}
+
+int __cdecl mtx_timedlock(_In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+{
+	return _Mtx_clocklock_at(mutex, TIME_UTC, time_point, _Prof_site());
+}
+
+int __cdecl _Mtx_clocklock(_In_ mtx_t* restrict mutex, int base, _In_ const struct timespec* restrict time_point)
+{
+	return _Mtx_clocklock_at(mutex, base, time_point, _Prof_site());
+}
+
+int __cdecl mtx_trylock(_In_ mtx_t* mutex)
+{
+	int r = _Mtx_trylock_impl(mutex);
+	if (!r && _Prof_on()) _Prof_acquired(mutex, _Mtx_prof_kind(mutex), 0, _Prof_site());
+	return r;
+}
+
+int __cdecl _Mtx_tryslock(_In_ mtx_t* mutex)
+{
+	int r = _Mtx_tryslock_impl(mutex);
+	if (!r && _Prof_on()) _Prof_acquired(mutex, thrd_prof_shared, 0, _Prof_site());
+	return r;
+}
+
+int __cdecl mtx_unlock(_In_ mtx_t* mutex)
+{
+	if (_Prof_on()) _Prof_released(mutex);
+	return _Mtx_unlock_impl(mutex);
+}
+
+int __cdecl _Mtx_sunlock(_In_ mtx_t* mutex)
+{
+	if (_Prof_on()) _Prof_released(mutex);
+	return _Mtx_sunlock_impl(mutex);
+}
+
+int __cdecl _Mtx_upgrade(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers) return _Mtx_distributed_upgrade(mutex, true);
+	return _Rw_upgrade(mutex);
+}
+
+int __cdecl _Mtx_tryupgrade(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers) return _Mtx_distributed_upgrade(mutex, false);
+	return _Rw_tryupgrade(mutex);
+}
+
+int __cdecl _Mtx_downgrade(_In_ mtx_t* mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	if (mutex->readers)
+		_Mtx_distributed_downgrade(mutex);
+	else
+		_Rw_unlock(mutex, 1);
+	return thrd_success;
+}
+
+void __cdecl mtx_destroy(_In_ mtx_t* mutex)
+{
+	// Neither the lock word nor the reader/writer state holds any resource.
+	assert(mutex->basetype == _Mtx_shared ? !mutex->obj.rw.state : mutex->obj.word == _WORD_UNLOCKED);
+	assert(!mutex->morphed);
+	free(mutex->readers);
+	mutex->readers = NULL;
+}
+
+int __cdecl _Mtx_compact_init(_Out_ _Mtx_compact_t* mutex)
+{
+	mutex->word = _WORD_UNLOCKED;
+	return thrd_success;
+}
+
+int __cdecl _Mtx_compact_lock(_In_ _Mtx_compact_t* mutex)
+{
+	_Mtx_word_lock(&mutex->word);
+	return thrd_success;
+}
+
+int __cdecl _Mtx_compact_timedlock(_In_ _Mtx_compact_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Mtx_word_timedlock(&mutex->word, deadline);
+}
+
+int __cdecl _Mtx_compact_trylock(_In_ _Mtx_compact_t* mutex)
+{
+	if (_Mtx_word_trylock(&mutex->word))
+		return thrd_success;
+	else
+		return thrd_busy;
+}
+
+int __cdecl _Mtx_compact_unlock(_In_ _Mtx_compact_t* mutex)
+{
+	_Mtx_word_unlock(&mutex->word);
+	return thrd_success;
+}
+
+struct _Thrd_lock_table
+{
+	_Mtx_padded_t* _Stripes;
+	size_t _Mask;
+	// The memory of the stripes, before aligned
+	void* _Memory;
+};
+
+int __cdecl thrd_lock_table_create(_Out_ thrd_lock_table_t* table, size_t count)
+{
+	*table = NULL;
+	if (!count || count > ((size_t)1 << 24)) return thrd_error;
+	size_t size = 1;
+	while (size < count) size <<= 1;
+	struct _Thrd_lock_table* t = malloc(sizeof(struct _Thrd_lock_table));
+	if (!t) return thrd_nomem;
+	// Over-allocate to align the stripes to cache lines.
+	t->_Memory = calloc(size + 1, sizeof(_Mtx_padded_t));
+	if (!t->_Memory)
+	{
+		free(t);
+		return thrd_nomem;
+	}
+	uintptr_t aligned = ((uintptr_t)t->_Memory + _THRD_CACHE_LINE - 1) & ~(uintptr_t)(_THRD_CACHE_LINE - 1);
+	t->_Stripes = (_Mtx_padded_t*)aligned;
+	t->_Mask = size - 1;
+	*table = t;
+	return thrd_success;
+}
+
+static size_t _Lock_table_index(_In_ struct _Thrd_lock_table* table, size_t hash)
+{
+	// Fibonacci hashing, taking the well mixed high bits.
+	unsigned long long h = (unsigned long long)hash * 0x9E3779B97F4A7C15ull;
+	return (size_t)(h >> 32) & table->_Mask;
+}
+
+_Mtx_compact_t* __cdecl thrd_lock_table_get(_In_ thrd_lock_table_t table, size_t hash)
+{
+	return &table->_Stripes[_Lock_table_index(table, hash)].mutex;
+}
+
+_Mtx_compact_t* __cdecl thrd_lock_table_get_addr(_In_ thrd_lock_table_t table, _In_ const void* addr)
+{
+	// The low bits are mostly zero because of alignment.
+	return thrd_lock_table_get(table, (size_t)((uintptr_t)addr >> 4));
+}
+
+int __cdecl thrd_lock_table_lock_pair(_In_ thrd_lock_table_t table, size_t hash1, size_t hash2)
+{
+	size_t i = _Lock_table_index(table, hash1);
+	size_t j = _Lock_table_index(table, hash2);
+	// Always the lower stripe first, so that two pairs never deadlock.
+	if (i > j)
+	{
+		size_t k = i;
+		i = j;
+		j = k;
+	}
+	_Mtx_word_lock(&table->_Stripes[i].mutex.word);
+	if (i != j) _Mtx_word_lock(&table->_Stripes[j].mutex.word);
+	return thrd_success;
+}
+
+int __cdecl thrd_lock_table_unlock_pair(_In_ thrd_lock_table_t table, size_t hash1, size_t hash2)
+{
+	size_t i = _Lock_table_index(table, hash1);
+	size_t j = _Lock_table_index(table, hash2);
+	_Mtx_word_unlock(&table->_Stripes[i].mutex.word);
+	if (i != j) _Mtx_word_unlock(&table->_Stripes[j].mutex.word);
+	return thrd_success;
+}
+
+void __cdecl thrd_lock_table_destroy(_In_ thrd_lock_table_t table)
+{
+	free(table->_Memory);
+	free(table);
+}
+
+// The most pauses between two tries of a spin lock
+#define _SPINLOCK_BACKOFF_MAX 1024
+
+int __cdecl thrd_spinlock_init(_Out_ thrd_spinlock_t* lock)
+{
+	lock->locked = 0;
+	return thrd_success;
+}
+
+int __cdecl thrd_spinlock_lock(_In_ thrd_spinlock_t* lock)
+{
+	if (!InterlockedExchange(&lock->locked, 1)) return thrd_success;
+	LONG backoff = 1;
+	for (;;)
+	{
+		// Wait with plain reads, so that the cache line is shared while locked.
+		while (ReadNoFence(&lock->locked))
+		{
+			for (LONG i = 0; i < backoff; i++) YieldProcessor();
+			if (backoff < _SPINLOCK_BACKOFF_MAX)
+				backoff *= 2;
+			else
+				// The owner may be preempted by us.
+				thrd_yield();
+		}
+		if (!InterlockedExchange(&lock->locked, 1)) return thrd_success;
+	}
+}
+
+int __cdecl thrd_spinlock_trylock(_In_ thrd_spinlock_t* lock)
+{
+	if (!ReadNoFence(&lock->locked) && !InterlockedExchange(&lock->locked, 1))
+		return thrd_success;
+	else
+		return thrd_busy;
+}
+
+int __cdecl thrd_spinlock_unlock(_In_ thrd_spinlock_t* lock)
+{
+	WriteRelease(&lock->locked, 0);
+	return thrd_success;
+}
+
+void __cdecl thrd_spinlock_destroy(_In_ thrd_spinlock_t* lock)
+{
+	assert(!lock->locked);
+	(void)lock;
+}
+
+// States of an MCS node
+#define _MCS_OWNED 0
+#define _MCS_WAITING 1
+#define _MCS_PARKED 2
+
+// Times to spin on the node before parking
+#define _MCS_SPIN_COUNT 4096
+
+int __cdecl thrd_mcs_init(_Out_ thrd_mcs_t* lock)
+{
+	lock->tail = NULL;
+	return thrd_success;
+}
+
+int __cdecl thrd_mcs_lock(_In_ thrd_mcs_t* restrict lock, _Out_ thrd_mcs_node_t* restrict node)
+{
+	node->next = NULL;
+	node->locked = _MCS_WAITING;
+	thrd_mcs_node_t* prev = InterlockedExchangePointer((PVOID volatile*)&lock->tail, node);
+	if (!prev) return thrd_success;
+	WritePointerRelease((PVOID volatile*)&prev->next, node);
+	for (int i = 0; i < _MCS_SPIN_COUNT; i++)
+	{
+		if (ReadAcquire(&node->locked) == _MCS_OWNED) return thrd_success;
+		YieldProcessor();
+	}
+	// The owner wakes us only if it sees the node parked.
+	if (InterlockedCompareExchange(&node->locked, _MCS_PARKED, _MCS_WAITING) == _MCS_WAITING)
+	{
+		while (ReadAcquire(&node->locked) == _MCS_PARKED)
+			_Atomic_wait(&node->locked, _MCS_PARKED, _NO_DEADLINE);
+	}
+	return thrd_success;
+}
+
+int __cdecl thrd_mcs_trylock(_In_ thrd_mcs_t* restrict lock, _Out_ thrd_mcs_node_t* restrict node)
+{
+	node->next = NULL;
+	node->locked = _MCS_OWNED;
+	if (!ReadPointerNoFence((PVOID volatile*)&lock->tail) &&
+		!InterlockedCompareExchangePointer((PVOID volatile*)&lock->tail, node, NULL))
+		return thrd_success;
+	else
+		return thrd_busy;
+}
+
+int __cdecl thrd_mcs_unlock(_In_ thrd_mcs_t* restrict lock, _In_ thrd_mcs_node_t* restrict node)
+{
+	thrd_mcs_node_t* next = ReadPointerAcquire((PVOID volatile*)&node->next);
+	if (!next)
+	{
+		// No one behind us.
+		if (InterlockedCompareExchangePointer((PVOID volatile*)&lock->tail, NULL, node) == node)
+			return thrd_success;
+		// A waiter has swapped the tail, but not linked its node yet.
+		while (!(next = ReadPointerAcquire((PVOID volatile*)&node->next)))
+			YieldProcessor();
+	}
+	if (InterlockedExchange(&next->locked, _MCS_OWNED) == _MCS_PARKED)
+		_Atomic_notify_one(&next->locked);
+	return thrd_success;
+}
+
+void __cdecl thrd_mcs_destroy(_In_ thrd_mcs_t* lock)
+{
+	assert(!lock->tail);
+	(void)lock;
+}
+
+// Orders the loads before it with the loads after it.
+#if defined(_M_ARM64)
+#define _Load_fence() __dmb(_ARM64_BARRIER_ISHLD)
+#elif defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+// Loads are not reordered with other loads.
+#define _Load_fence() _ReadWriteBarrier()
+#elif defined(__GNUC__)
+#define _Load_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define _Load_fence() MemoryBarrier()
+#endif
+
+// Times to spin for the writer before yielding
+#define _SEQLOCK_SPIN_COUNT 64
+
+int __cdecl thrd_seqlock_init(_Out_ thrd_seqlock_t* lock)
+{
+	lock->seq = 0;
+	lock->lock = _WORD_UNLOCKED;
+	return thrd_success;
+}
+
+unsigned int __cdecl thrd_seqlock_read_begin(_In_ const thrd_seqlock_t* lock)
+{
+	LONG seq;
+	int spins = 0;
+	while ((seq = ReadAcquire(&lock->seq)) & 1)
+	{
+		// The writers are short, but may be preempted.
+		if (++spins < _SEQLOCK_SPIN_COUNT)
+			YieldProcessor();
+		else
+			thrd_yield();
+	}
+	return (unsigned int)seq;
+}
+
+bool __cdecl thrd_seqlock_read_retry(_In_ const thrd_seqlock_t* lock, unsigned int seq)
+{
+	_Load_fence();
+	return (unsigned int)ReadNoFence(&lock->seq) != seq;
+}
+
+int __cdecl thrd_seqlock_write_lock(_In_ thrd_seqlock_t* lock)
+{
+	_Mtx_word_lock(&lock->lock);
+	// A full barrier, so that the readers see it odd before the data changes.
+	InterlockedIncrement(&lock->seq);
+	return thrd_success;
+}
+
+int __cdecl thrd_seqlock_write_unlock(_In_ thrd_seqlock_t* lock)
+{
+	WriteRelease(&lock->seq, ReadNoFence(&lock->seq) + 1);
+	_Mtx_word_unlock(&lock->lock);
+	return thrd_success;
+}
+
+int __cdecl thrd_seqlock_read(_In_ const thrd_seqlock_t* lock, _Out_writes_bytes_(size) void* restrict dest, _In_reads_bytes_(size) const void* restrict src, size_t size)
+{
+	unsigned int seq;
+	do
+	{
+		seq = thrd_seqlock_read_begin(lock);
+		// The copy may be torn, and then it is retried.
+		memcpy(dest, src, size);
+	} while (thrd_seqlock_read_retry(lock, seq));
+	return thrd_success;
+}
+
+int __cdecl thrd_seqlock_write(_In_ thrd_seqlock_t* lock, _Out_writes_bytes_(size) void* restrict dest, _In_reads_bytes_(size) const void* restrict src, size_t size)
+{
+	thrd_seqlock_write_lock(lock);
+	memcpy(dest, src, size);
+	thrd_seqlock_write_unlock(lock);
+	return thrd_success;
+}
+
+void __cdecl thrd_seqlock_destroy(_In_ thrd_seqlock_t* lock)
+{
+	assert(!(lock->seq & 1) && !lock->lock);
+	(void)lock;
+}
+
+#ifdef _WIN32
+static BOOL WINAPI _Init_once_callback(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+{
+	// Ignore some params
+	(void)initOnce;
+	(void)context;
+	// Call the function
+	void (*func)(void) = (void (*)(void))parameter;
+	func();
+	return TRUE;
+}
+
+void __cdecl call_once(_In_ once_flag* flag, _In_ void(__cdecl* func)(void))
+{
+	BOOL r = InitOnceExecuteOnce((PINIT_ONCE)flag, _Init_once_callback, (void*)func, NULL);
+	assert(r);
+	(void)r;
+}
+#else
+void __cdecl call_once(_In_ once_flag* flag, _In_ void(__cdecl* func)(void))
+{
+	int r = pthread_once(flag, func);
+	assert(!r);
+	(void)r;
+}
+#endif // _WIN32
+
+int __cdecl cnd_init(_Out_ cnd_t* cond)
+{
+	cond->lock = _WORD_UNLOCKED;
+	cond->head = NULL;
+	cond->tail = NULL;
+	cond->mutex = NULL;
+	return thrd_success;
+}
+
+// Removes the waiter from the queue, with the lock held.
+static void _Cnd_unlink(_In_ cnd_t* cond, _In_ struct _Cnd_waiter* waiter)
+{
+	if (waiter->_Prev)
+		waiter->_Prev->_Next = waiter->_Next;
+	else
+		cond->head = waiter->_Next;
+	if (waiter->_Next)
+		waiter->_Next->_Prev = waiter->_Prev;
+	else
+		cond->tail = waiter->_Prev;
+}
+
+int __cdecl cnd_signal(_In_ cnd_t* cond)
+{
+	if (!ReadPointerAcquire((PVOID volatile*)&cond->head)) return thrd_success;
+	// Only with waiters, as the wakeup chains matter.
+	_Trace(_TRACE_CND_NOTIFY, cond);
+	_Mtx_word_lock(&cond->lock);
+	struct _Cnd_waiter* waiter = cond->head;
+	if (waiter)
+	{
+		_Cnd_unlink(cond, waiter);
+		WriteRelease(&waiter->_State, _CND_SIGNALED);
+	}
+	_Mtx_word_unlock(&cond->lock);
+	// The waiter may have returned, but waking a stale address is harmless.
+	if (waiter) _Atomic_notify_one(&waiter->_State);
+	return thrd_success;
+}
+
+// Moves the waiters to the mutex, instead of waking them all to fight for it.
+static void _Cnd_morph(_In_ mtx_t* mutex, _In_ struct _Cnd_waiter* head, _In_ struct _Cnd_waiter* tail)
+{
+	struct _Cnd_waiter* old = ReadPointerAcquire((PVOID volatile*)&mutex->morphed);
+	for (;;)
+	{
+		tail->_Next = old;
+		struct _Cnd_waiter* prev = InterlockedCompareExchangePointer((PVOID volatile*)&mutex->morphed, head, old);
+		if (prev == old) break;
+		old = prev;
+	}
+	// Make sure that someone unlocks the mutex through the contended path.
+	for (;;)
+	{
+		LONG state = ReadAcquire(&mutex->obj.word);
+		if (state == _WORD_CONTENDED) break;
+		if (state == _WORD_LOCKED)
+		{
+			if (InterlockedCompareExchange(&mutex->obj.word, _WORD_CONTENDED, _WORD_LOCKED) == _WORD_LOCKED)
+				break;
+		}
+		else if (InterlockedCompareExchange(&mutex->obj.word, _WORD_CONTENDED, _WORD_UNLOCKED) == _WORD_UNLOCKED)
+		{
+			// No owner, we own it for a moment to hand it.
+			_Mtx_release(mutex);
+			break;
+		}
+	}
+}
+
+int __cdecl cnd_broadcast(_In_ cnd_t* cond)
+{
+	if (!ReadPointerAcquire((PVOID volatile*)&cond->head)) return thrd_success;
+	_Trace(_TRACE_CND_NOTIFY, cond);
+	_Mtx_word_lock(&cond->lock);
+	struct _Cnd_waiter* head = cond->head;
+	struct _Cnd_waiter* tail = cond->tail;
+	mtx_t* mutex = cond->mutex;
+	cond->head = NULL;
+	cond->tail = NULL;
+	// Shared mutexes cannot be handed one by one.
+	bool morph = mutex && mutex->basetype != _Mtx_shared;
+	for (struct _Cnd_waiter* waiter = head; waiter;)
+	{
+		struct _Cnd_waiter* next = waiter->_Next;
+		if (morph)
+		{
+			WriteNoFence(&waiter->_State, _CND_MORPHED);
+		}
+		else
+		{
+			WriteRelease(&waiter->_State, _CND_SIGNALED);
+			_Atomic_notify_one(&waiter->_State);
+		}
+		waiter = next;
+	}
+	_Mtx_word_unlock(&cond->lock);
+	if (morph && head) _Cnd_morph(mutex, head, tail);
+	return thrd_success;
+}
+
+// Waits until the deadline, with the mutex locked shared or exclusive.
+static int _Cnd_wait_impl(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, LONGLONG deadline, bool shared, void* site)
+{
+	LONGLONG begin = _Prof_on() ? _Ticks_now() : 0;
+	struct _Cnd_waiter waiter;
+	waiter._State = _CND_QUEUED;
+	waiter._Next = NULL;
+	_Mtx_word_lock(&cond->lock);
+	waiter._Prev = cond->tail;
+	if (cond->tail)
+		cond->tail->_Next = &waiter;
+	else
+		cond->head = &waiter;
+	cond->tail = &waiter;
+	cond->mutex = mutex;
+	_Mtx_word_unlock(&cond->lock);
+
+	// A recursive mutex should be released entirely.
+	unsigned int count = mutex->count;
+	if (mutex->recursive) mutex->count = 1;
+	int r = shared ? _Mtx_sunlock(mutex) : mtx_unlock(mutex);
+	if (r)
+	{
+		mutex->count = count;
+		_Mtx_word_lock(&cond->lock);
+		if (ReadNoFence(&waiter._State) == _CND_QUEUED)
+		{
+			_Cnd_unlink(cond, &waiter);
+			_Mtx_word_unlock(&cond->lock);
+			return r;
+		}
+		// Signaled already, consume it as a spurious wakeup.
+		_Mtx_word_unlock(&cond->lock);
+		deadline = _NO_DEADLINE;
+	}
+	// Begins after the mutex is released, so that a failed release leaves no open wait.
+	_Trace(_TRACE_CND_WAIT, cond);
+
+	int ret = thrd_success;
+	LONG state;
+	while ((state = ReadAcquire(&waiter._State)) == _CND_QUEUED || state == _CND_MORPHED)
+	{
+		if (!_Atomic_wait(&waiter._State, state, deadline))
+		{
+			_Mtx_word_lock(&cond->lock);
+			if (ReadNoFence(&waiter._State) == _CND_QUEUED)
+			{
+				_Cnd_unlink(cond, &waiter);
+				ret = thrd_timedout;
+			}
+			_Mtx_word_unlock(&cond->lock);
+			if (ret) break;
+			// A wakeup is on the way, and it should not be lost.
+			deadline = _NO_DEADLINE;
+		}
+	}
+
+	_Trace(ret ? _TRACE_CND_TIMEOUT : _TRACE_CND_WAKE, cond);
+	if (begin) _Prof_waited(cond, thrd_prof_cond, begin, site);
+	if (shared)
+	{
+		_Mtx_slock_at(mutex, site);
+	}
+	else if (state == _CND_HANDED)
+	{
+		LONGLONG handed = _Prof_on() ? _Ticks_now() : 0;
+		_Mtx_word_lock_contended(&mutex->obj.word);
+		_Mtx_set_owner(mutex);
+		if (handed) _Prof_acquired(mutex, thrd_prof_mutex, handed, site);
+	}
+	else
+	{
+		_Mtx_lock_at(mutex, site);
+	}
+	if (mutex->recursive) mutex->count = count;
+	return r ? r : ret;
+}
+
+int __cdecl cnd_wait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex)
+{
+	return _Cnd_wait_impl(cond, mutex, _NO_DEADLINE, false, _Prof_site());
+}
+
+int __cdecl cnd_timedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Cnd_wait_impl(cond, mutex, deadline, false, _Prof_site());
+}
+
+int __cdecl _Cnd_clockwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, int base, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, base, &deadline)) return thrd_error;
+	return _Cnd_wait_impl(cond, mutex, deadline, false, _Prof_site());
+}
+
+int __cdecl _Cnd_swait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	return _Cnd_wait_impl(cond, mutex, _NO_DEADLINE, true, _Prof_site());
+}
+
+int __cdecl _Cnd_stimedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+{
+	if (mutex->basetype != _Mtx_shared) return thrd_error;
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Cnd_wait_impl(cond, mutex, deadline, true, _Prof_site());
+}
+
+void __cdecl cnd_destroy(_In_ cnd_t* cond)
+{
+	// Nothing to release, but no one should be waiting.
+	assert(!cond->head);
+	(void)cond;
+}
+
+int __cdecl _Smph_init(_Out_ _Smph_t* sem, int max_count, int count)
+{
+	if (max_count <= 0 || count < 0 || count > max_count)
+		return thrd_error;
+	sem->count = count;
+	sem->waiters = 0;
+	sem->max_count = max_count;
+	return thrd_success;
+}
+
+// Times to spin before parking on the count
+#define _SMPH_SPIN_COUNT 64
+
+static bool _Smph_try_acquire(_In_ _Smph_t* sem)
+{
+	LONG count = ReadNoFence(&sem->count);
+	while (count > 0)
+	{
+		LONG prev = InterlockedCompareExchange(&sem->count, count - 1, count);
+		if (prev == count) return true;
+		count = prev;
+	}
+	return false;
+}
+
+static int _Smph_wait_impl(_In_ _Smph_t* sem, LONGLONG deadline)
+{
+	if (_Smph_try_acquire(sem)) return thrd_success;
+	for (int i = 0; i < _SMPH_SPIN_COUNT; i++)
+	{
+		YieldProcessor();
+		if (ReadNoFence(&sem->count) > 0 && _Smph_try_acquire(sem))
+			return thrd_success;
+	}
+	// Register as a waiter before checking the count again,
+	// so that a concurrent post either sees us or we see its count.
+	InterlockedIncrement(&sem->waiters);
+	int ret = thrd_success;
+	while (!_Smph_try_acquire(sem))
+	{
+		if (!_Atomic_wait(&sem->count, 0, deadline))
+		{
+			ret = thrd_timedout;
+			break;
+		}
+	}
+	InterlockedDecrement(&sem->waiters);
+	return ret;
+}
+
+// Records the wait when profiling.
+static int _Smph_wait_at(_In_ _Smph_t* sem, LONGLONG deadline, void* site)
+{
+	if (!_Prof_on() && !_Trace_on()) return _Smph_wait_impl(sem, deadline);
+	LONGLONG begin = 0;
+	if (!_Smph_try_acquire(sem))
+	{
+		begin = _Ticks_now();
+		_Trace(_TRACE_SMPH_WAIT, sem);
+		int r = _Smph_wait_impl(sem, deadline);
+		_Trace(r ? _TRACE_SMPH_TIMEOUT : _TRACE_SMPH_ACQUIRED, sem);
+		if (r) return r;
+	}
+	if (_Prof_on()) _Prof_waited(sem, thrd_prof_semaphore, begin, site);
+	return thrd_success;
+}
+
+int __cdecl _Smph_wait(_In_ _Smph_t* sem)
+{
+	return _Smph_wait_at(sem, _NO_DEADLINE, _Prof_site());
+}
+
+int __cdecl _Smph_timedwait(_In_ _Smph_t* restrict sem, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Smph_wait_at(sem, deadline, _Prof_site());
+}
+
+int __cdecl _Smph_clockwait(_In_ _Smph_t* restrict sem, int base, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, base, &deadline)) return thrd_error;
+	return _Smph_wait_at(sem, deadline, _Prof_site());
+}
+
+int __cdecl _Smph_trywait(_In_ _Smph_t* sem)
+{
+	if (_Smph_try_acquire(sem))
+		return thrd_success;
+	else
+		return thrd_timedout;
+}
+
+int __cdecl _Smph_post(_In_ _Smph_t* sem)
+{
+	return _Smph_multipost(sem, 1);
+}
+
+int __cdecl _Smph_multipost(_In_ _Smph_t* sem, int count)
+{
+	if (count <= 0) return thrd_error;
+	LONG current = ReadNoFence(&sem->count);
+	for (;;)
+	{
+		// Never exceed the maximum count, as ReleaseSemaphore does.
+		if (current > sem->max_count - count) return thrd_error;
+		LONG prev = InterlockedCompareExchange(&sem->count, current + count, current);
+		if (prev == current) break;
+		current = prev;
+	}
+	_Trace(_TRACE_SMPH_POST, sem);
+	if (ReadAcquire(&sem->waiters))
+	{
+		if (count == 1)
+			_Atomic_notify_one(&sem->count);
+		else
+			_Atomic_notify_all(&sem->count);
+	}
+	return thrd_success;
+}
+
+int __cdecl _Smph_post_slow(_In_ _Smph_t* sem, bool posted)
+{
+	if (!posted) return _Smph_multipost(sem, 1);
+	_Trace(_TRACE_SMPH_POST, sem);
+	_Atomic_notify_one(&sem->count);
+	return thrd_success;
+}
+
+int __cdecl _Smph_get(_In_ _Smph_t* restrict sem, int* restrict count)
+{
+	if (count) *count = ReadAcquire(&sem->count);
+	return thrd_success;
+}
+
+void __cdecl _Smph_destroy(_In_ _Smph_t* sem)
+{
+	// Nothing to release, but no one should be waiting.
+	assert(!sem->waiters);
+	(void)sem;
+}
+
+// Bounds of the adaptive spin limits
+#define _SPIN_MIN 16
+#define _SPIN_MAX 4096
+
+// Spins while *address == compare, at most *limit times.
+// The limit grows when spinning pays off, and shrinks when it does not.
+// Returns true if the value has changed.
+static bool _Atomic_spin(volatile LONG* address, LONG compare, volatile LONG* limit)
+{
+	LONG n = ReadNoFence(limit);
+	// Zero for the static initializers.
+	if (n < _SPIN_MIN) n = _SPIN_MIN;
+	for (LONG i = 0; i < n; i++)
+	{
+		YieldProcessor();
+		if (ReadAcquire(address) != compare)
+		{
+			if (n < _SPIN_MAX) WriteNoFence(limit, n * 2);
+			return true;
+		}
+	}
+	if (n > _SPIN_MIN) WriteNoFence(limit, n / 2);
+	return false;
+}
+
+// Waits while *address == compare, spinning before parking.
+static void _Atomic_spin_wait(volatile LONG* address, LONG compare, volatile LONG* waiters, volatile LONG* limit)
+{
+	if (ReadAcquire(address) != compare || _Atomic_spin(address, compare, limit)) return;
+	// Register as a waiter before checking again,
+	// so that the waker either sees us or we see its value.
+	InterlockedIncrement(waiters);
+	while (ReadAcquire(address) == compare)
+		_Atomic_wait(address, compare, _NO_DEADLINE);
+	InterlockedDecrement(waiters);
+}
+
+int __cdecl thrd_barrier_init(_Out_ thrd_barrier_t* barrier, int count, _In_opt_ thrd_barrier_completion_t completion, void* arg)
+{
+	if (count <= 0) return thrd_error;
+	barrier->count = count;
+	barrier->sense = 0;
+	barrier->waiters = 0;
+	barrier->spin = _SPIN_MIN;
+	barrier->expected = count;
+	barrier->completion = completion;
+	barrier->arg = arg;
+	return thrd_success;
+}
+
+int __cdecl thrd_barrier_wait(_In_ thrd_barrier_t* barrier)
+{
+	// The phase cannot complete before we arrive,
+	// so the sense read here is the one of our phase.
+	LONG sense = ReadAcquire(&barrier->sense);
+	if (InterlockedDecrement(&barrier->count))
+	{
+		_Atomic_spin_wait(&barrier->sense, sense, &barrier->waiters, &barrier->spin);
+		return thrd_success;
+	}
+	// The last one runs the completion, and resets the count before releasing the others.
+	if (barrier->completion) barrier->completion(barrier->arg);
+	WriteNoFence(&barrier->count, barrier->expected);
+	InterlockedExchange(&barrier->sense, !sense);
+	if (ReadAcquire(&barrier->waiters)) _Atomic_notify_all(&barrier->sense);
+	return thrd_success;
+}
+
+void __cdecl thrd_barrier_destroy(_In_ thrd_barrier_t* barrier)
+{
+	// Nothing to release, but no one should be waiting.
+	assert(!barrier->waiters);
+	(void)barrier;
+}
+
+int __cdecl thrd_latch_init(_Out_ thrd_latch_t* latch, int count)
+{
+	if (count < 0) return thrd_error;
+	latch->count = count;
+	latch->waiters = 0;
+	latch->spin = _SPIN_MIN;
+	return thrd_success;
+}
+
+int __cdecl thrd_latch_count_down(_In_ thrd_latch_t* latch, int n)
+{
+	if (n < 0) return thrd_error;
+	LONG current = ReadNoFence(&latch->count);
+	for (;;)
+	{
+		if (current < n) return thrd_error;
+		LONG prev = InterlockedCompareExchange(&latch->count, current - n, current);
+		if (prev == current) break;
+		current = prev;
+	}
+	if (current == n && ReadAcquire(&latch->waiters))
+		_Atomic_notify_all(&latch->count);
+	return thrd_success;
+}
+
+int __cdecl thrd_latch_wait(_In_ thrd_latch_t* latch)
+{
+	LONG current;
+	while ((current = ReadAcquire(&latch->count)) != 0)
+		_Atomic_spin_wait(&latch->count, current, &latch->waiters, &latch->spin);
+	return thrd_success;
+}
+
+int __cdecl thrd_latch_try_wait(_In_ thrd_latch_t* latch)
+{
+	if (ReadAcquire(&latch->count))
+		return thrd_busy;
+	else
+		return thrd_success;
+}
+
+int __cdecl thrd_latch_arrive_and_wait(_In_ thrd_latch_t* latch, int n)
+{
+	int r = thrd_latch_count_down(latch, n);
+	if (r) return r;
+	return thrd_latch_wait(latch);
+}
+
+void __cdecl thrd_latch_destroy(_In_ thrd_latch_t* latch)
+{
+	// Nothing to release, but no one should be waiting.
+	assert(!latch->waiters);
+	(void)latch;
+}
+
+int __cdecl thrd_eventcount_init(_Out_ thrd_eventcount_t* ec)
+{
+	ec->epoch = 0;
+	ec->waiters = 0;
+	return thrd_success;
+}
+
+static LONG _Eventcount_prepare(_In_ thrd_eventcount_t* ec)
+{
+	// The increment is a full barrier before checking the condition again.
+	InterlockedIncrement(&ec->waiters);
+	return ReadAcquire(&ec->epoch);
+}
+
+int __cdecl thrd_eventcount_prepare_wait(_In_ thrd_eventcount_t* ec, _Out_ int* key)
+{
+	*key = (int)_Eventcount_prepare(ec);
+	return thrd_success;
+}
+
+int __cdecl thrd_eventcount_cancel_wait(_In_ thrd_eventcount_t* ec)
+{
+	InterlockedDecrement(&ec->waiters);
+	return thrd_success;
+}
+
+// Returns false if the deadline has passed.
+static bool _Eventcount_wait(_In_ thrd_eventcount_t* ec, LONG key, LONGLONG deadline)
+{
+	bool r = true;
+	while (ReadAcquire(&ec->epoch) == key)
+	{
+		if (!_Atomic_wait(&ec->epoch, key, deadline))
+		{
+			r = false;
+			break;
+		}
+	}
+	InterlockedDecrement(&ec->waiters);
+	return r;
+}
+
+int __cdecl thrd_eventcount_commit_wait(_In_ thrd_eventcount_t* ec, int key)
+{
+	_Eventcount_wait(ec, (LONG)key, _NO_DEADLINE);
+	return thrd_success;
+}
+
+int __cdecl thrd_eventcount_commit_timedwait(_In_ thrd_eventcount_t* restrict ec, int key, _In_ const struct timespec* restrict time_point)
+{
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline))
+	{
+		thrd_eventcount_cancel_wait(ec);
+		return thrd_error;
+	}
+	if (_Eventcount_wait(ec, (LONG)key, deadline))
+		return thrd_success;
+	else
+		return thrd_timedout;
+}
+
+static void _Eventcount_wake(_In_ thrd_eventcount_t* ec, bool all)
+{
+	if (!ReadAcquire(&ec->waiters)) return;
+	InterlockedIncrement(&ec->epoch);
+	if (all)
+		_Atomic_notify_all(&ec->epoch);
+	else
+		_Atomic_notify_one(&ec->epoch);
+}
+
+int __cdecl thrd_eventcount_notify_one(_In_ thrd_eventcount_t* ec)
+{
+	_Eventcount_wake(ec, false);
+	return thrd_success;
+}
+
+int __cdecl thrd_eventcount_notify_all(_In_ thrd_eventcount_t* ec)
+{
+	_Eventcount_wake(ec, true);
+	return thrd_success;
+}
+
+// Notifies after a change of the condition published by a plain store.
+static void _Eventcount_notify(_In_ thrd_eventcount_t* ec, bool all)
+{
+	// Order the change before reading the waiters.
+	MemoryBarrier();
+	_Eventcount_wake(ec, all);
+}
+
+void __cdecl thrd_eventcount_destroy(_In_ thrd_eventcount_t* ec)
+{
+	// Nothing to release, but no one should be waiting.
+	assert(!ec->waiters);
+	(void)ec;
+}
+
+// A task in the pool
+typedef struct
+{
+	thrd_task_t _Func;
+	void* _Arg;
+} _Pool_task;
+
+// The circular array of a deque, followed by its tasks
+typedef struct _Pool_array
+{
+	LONG64 _Mask;
+	// Previous arrays may still be read by the thieves,
+	// thus they are freed with the pool.
+	struct _Pool_array* _Prev;
+} _Pool_array;
+
+#define _Pool_array_tasks(array) ((_Pool_task*)((array) + 1))
+
+typedef struct
+{
+	volatile LONG64 _Top;
+	char _Pad0[_CACHE_LINE - sizeof(LONG64)];
+	volatile LONG64 _Bottom;
+	_Pool_array* volatile _Array;
+	struct _Thrd_pool* _Pool;
+	thrd_t _Thread;
+	unsigned int _Seed;
+	char _Pad1[_CACHE_LINE];
+} _Pool_worker;
+
+// The queue of tasks submitted from other threads
+typedef struct
+{
+	volatile LONG _Lock;
+	volatile LONG _Count;
+	size_t _Head;
+	size_t _Capacity;
+	_Pool_task* _Tasks;
+} _Pool_queue;
+
+struct _Thrd_pool
+{
+	_Pool_worker* _Workers;
+	int _Count;
+	_Pool_queue _Queue;
+	// The count of submitted but not completed tasks
+	volatile LONG _Pending;
+	// The count of workers going to park on _Wake
+	volatile LONG _Idle;
+	volatile LONG _Stop;
+	_Smph_t _Wake;
+	// The count of threads in thrd_pool_wait
+	volatile LONG _Waiters;
+	// Bumped on submissions and on the last completion, while there are waiters
+	volatile LONG _Signal;
+};
+
+#define _POOL_INIT_CAPACITY 256
+
+// Results of stealing
+#define _POOL_EMPTY 0
+#define _POOL_STOLEN 1
+#define _POOL_ABORT 2
+
+// The worker running on the current thread
+static thread_local _Pool_worker* _Pool_current = NULL;
+
+static _Pool_array* _Pool_array_new(LONG64 capacity)
+{
+	_Pool_array* array = malloc(sizeof(_Pool_array) + (size_t)capacity * sizeof(_Pool_task));
+	if (array)
+	{
+		array->_Mask = capacity - 1;
+		array->_Prev = NULL;
+	}
+	return array;
+}
+
+// Pushes a task to the bottom, called only by the owner.
+static int _Pool_push(_In_ _Pool_worker* worker, _In_ const _Pool_task* task)
+{
+	LONG64 b = ReadNoFence64(&worker->_Bottom);
+	LONG64 t = ReadAcquire64(&worker->_Top);
+	_Pool_array* array = worker->_Array;
+	if (b - t > array->_Mask)
+	{
+		_Pool_array* grown = _Pool_array_new((array->_Mask + 1) * 2);
+		if (!grown) return thrd_nomem;
+		for (LONG64 i = t; i < b; i++)
+			_Pool_array_tasks(grown)[i & grown->_Mask] = _Pool_array_tasks(array)[i & array->_Mask];
+		grown->_Prev = array;
+		WritePointerRelease((PVOID volatile*)&worker->_Array, grown);
+		array = grown;
+	}
+	_Pool_array_tasks(array)[b & array->_Mask] = *task;
+	WriteRelease64(&worker->_Bottom, b + 1);
+	return thrd_success;
+}
+
+// Takes a task from the bottom, called only by the owner.
+static bool _Pool_take(_In_ _Pool_worker* worker, _Out_ _Pool_task* task)
+{
+	LONG64 b = ReadNoFence64(&worker->_Bottom) - 1;
+	_Pool_array* array = worker->_Array;
+	// Publish the new bottom before reading the top.
+	InterlockedExchange64(&worker->_Bottom, b);
+	LONG64 t = ReadNoFence64(&worker->_Top);
+	if (t > b)
+	{
+		WriteNoFence64(&worker->_Bottom, b + 1);
+		return false;
+	}
+	*task = _Pool_array_tasks(array)[b & array->_Mask];
+	if (t == b)
+	{
+		// The last task, race with the thieves.
+		bool won = InterlockedCompareExchange64(&worker->_Top, t + 1, t) == t;
+		WriteNoFence64(&worker->_Bottom, b + 1);
+		return won;
+	}
+	return true;
+}
+
+// Steals a task from the top, called by any thread.
+static int _Pool_steal(_In_ _Pool_worker* worker, _Out_ _Pool_task* task)
+{
+	LONG64 t = ReadAcquire64(&worker->_Top);
+	MemoryBarrier();
+	LONG64 b = ReadAcquire64(&worker->_Bottom);
+	if (t >= b) return _POOL_EMPTY;
+	_Pool_array* array = ReadPointerAcquire((PVOID volatile*)&worker->_Array);
+	*task = _Pool_array_tasks(array)[t & array->_Mask];
+	if (InterlockedCompareExchange64(&worker->_Top, t + 1, t) != t)
+		return _POOL_ABORT;
+	return _POOL_STOLEN;
+}
+
+static int _Pool_enqueue(_In_ _Pool_queue* queue, _In_ thrd_task_t func, _In_reads_(count) void* const* args, size_t count)
+{
+	_Mtx_word_lock(&queue->_Lock);
+	size_t size = (size_t)queue->_Count;
+	if (size + count > queue->_Capacity)
+	{
+		size_t capacity = queue->_Capacity ? queue->_Capacity : _POOL_INIT_CAPACITY;
+		while (capacity < size + count) capacity *= 2;
+		_Pool_task* tasks = malloc(capacity * sizeof(_Pool_task));
+		if (!tasks)
+		{
+			_Mtx_word_unlock(&queue->_Lock);
+			return thrd_nomem;
+		}
+		for (size_t i = 0; i < size; i++)
+			tasks[i] = queue->_Tasks[(queue->_Head + i) % queue->_Capacity];
+		free(queue->_Tasks);
+		queue->_Tasks = tasks;
+		queue->_Head = 0;
+		queue->_Capacity = capacity;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		_Pool_task* task = &queue->_Tasks[(queue->_Head + size + i) % queue->_Capacity];
+		task->_Func = func;
+		task->_Arg = args[i];
+	}
+	WriteRelease(&queue->_Count, (LONG)(size + count));
+	_Mtx_word_unlock(&queue->_Lock);
+	return thrd_success;
+}
+
+static bool _Pool_dequeue(_In_ _Pool_queue* queue, _Out_ _Pool_task* task)
+{
+	// Avoid the lock when it is obviously empty.
+	if (!ReadAcquire(&queue->_Count)) return false;
+	_Mtx_word_lock(&queue->_Lock);
+	bool found = queue->_Count > 0;
+	if (found)
+	{
+		*task = queue->_Tasks[queue->_Head];
+		queue->_Head = (queue->_Head + 1) % queue->_Capacity;
+		WriteRelease(&queue->_Count, queue->_Count - 1);
+	}
+	_Mtx_word_unlock(&queue->_Lock);
+	return found;
+}
+
+// Finds a task from the own deque, the queue, or a random victim.
+// The worker is NULL if it is not called by a worker.
+static bool _Pool_find_task(_In_ struct _Thrd_pool* pool, _In_opt_ _Pool_worker* worker, _Out_ _Pool_task* task)
+{
+	if (worker && _Pool_take(worker, task)) return true;
+	if (_Pool_dequeue(&pool->_Queue, task)) return true;
+	unsigned int start = 0;
+	if (worker)
+	{
+		// xorshift32
+		unsigned int seed = worker->_Seed;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		worker->_Seed = seed;
+		start = seed;
+	}
+	bool retry = true;
+	while (retry)
+	{
+		retry = false;
+		for (int i = 0; i < pool->_Count; i++)
+		{
+			_Pool_worker* victim = &pool->_Workers[(start + (unsigned int)i) % (unsigned int)pool->_Count];
+			if (victim == worker) continue;
+			switch (_Pool_steal(victim, task))
+			{
+			case _POOL_STOLEN:
+				return true;
+			case _POOL_ABORT:
+				retry = true;
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+static bool _Pool_has_task(_In_ struct _Thrd_pool* pool)
+{
+	if (ReadAcquire(&pool->_Queue._Count)) return true;
+	for (int i = 0; i < pool->_Count; i++)
+	{
+		_Pool_worker* worker = &pool->_Workers[i];
+		if (ReadAcquire64(&worker->_Top) < ReadAcquire64(&worker->_Bottom)) return true;
 	}
-	return thrd_success;
+	return false;
 }
 
-int __cdecl thrd_equal(_In_ thrd_t lhs, _In_ thrd_t rhs)
+// Wakes the threads in thrd_pool_wait, to help or to return.
+// The change should be visible before reading the count of waiters,
+// and the waiters register before checking the pool.
+static void _Pool_signal(_In_ struct _Thrd_pool* pool)
 {
-	// The thread handle maybe a pseudo handle,
-	// thus we should compare their ids.
-	return GetThreadId(lhs) == GetThreadId(rhs);
+	if (ReadAcquire(&pool->_Waiters) <= 0) return;
+	InterlockedIncrement(&pool->_Signal);
+	_Atomic_notify_all(&pool->_Signal);
 }
 
-thrd_t __cdecl thrd_current(void)
+static void _Pool_run(_In_ struct _Thrd_pool* pool, _In_ const _Pool_task* task)
+{
+	task->_Func(task->_Arg);
+	if (!InterlockedDecrement(&pool->_Pending))
+		_Pool_signal(pool);
+}
+
+// Wakes the waiters, and at most count idle workers.
+static void _Pool_notify(_In_ struct _Thrd_pool* pool, size_t count)
 {
-	return GetCurrentThread();
+	// The tasks should be visible before reading the idle count,
+	// and the workers register as idle before checking the tasks.
+	MemoryBarrier();
+	_Pool_signal(pool);
+	LONG idle = ReadAcquire(&pool->_Idle);
+	if (idle <= 0) return;
+	int tokens;
+	_Smph_get(&pool->_Wake, &tokens);
+	if (tokens >= idle) return;
+	LONG wake = idle - tokens;
+	if ((size_t)wake > count) wake = (LONG)count;
+	// It fails only if others have posted enough.
+	_Smph_multipost(&pool->_Wake, wake);
 }
 
-static void _Timespec_setvalid(struct timespec* t)
+static int __cdecl _Pool_worker_main(void* arg)
 {
-	while (t->tv_nsec < 0)
+	_Pool_worker* worker = arg;
+	struct _Thrd_pool* pool = worker->_Pool;
+	_Pool_current = worker;
+	for (;;)
 	{
-		t->tv_sec--;
-		t->tv_nsec += 1000000000;
+		_Pool_task task;
+		if (_Pool_find_task(pool, worker, &task))
+		{
+			_Pool_run(pool, &task);
+			continue;
+		}
+		InterlockedIncrement(&pool->_Idle);
+		if (ReadAcquire(&pool->_Stop))
+		{
+			InterlockedDecrement(&pool->_Idle);
+			break;
+		}
+		if (!_Pool_has_task(pool))
+			_Smph_wait(&pool->_Wake);
+		InterlockedDecrement(&pool->_Idle);
 	}
+	_Pool_current = NULL;
+	// Returns to _Thrd_start, which clears the TSS as other threads.
+	return 0;
 }
 
-// Gets the duration of the time_point and now.
-static struct timespec _Timespec_duration(const struct timespec* time_point)
+static void _Pool_free(_In_ struct _Thrd_pool* pool)
 {
-	struct timespec current;
-	if (!timespec_get(&current, TIME_UTC))
+	for (int i = 0; i < pool->_Count; i++)
 	{
-		current.tv_sec = 0;
-		current.tv_nsec = 0;
-		return current;
+		_Pool_array* array = pool->_Workers[i]._Array;
+		while (array)
+		{
+			_Pool_array* prev = array->_Prev;
+			free(array);
+			array = prev;
+		}
 	}
-	struct timespec span;
-	span.tv_sec = time_point->tv_sec - current.tv_sec;
-	span.tv_nsec = time_point->tv_nsec - current.tv_nsec;
-	_Timespec_setvalid(&span);
-	return span;
+	free(pool->_Workers);
+	free(pool->_Queue._Tasks);
+	_Smph_destroy(&pool->_Wake);
+	free(pool);
 }
 
-static DWORD _Timespec_ms(const struct timespec* span)
+// Stops and joins the first count workers.
+static void _Pool_stop(_In_ struct _Thrd_pool* pool, int count)
 {
-	time_t ms = span->tv_sec * 1000 + span->tv_nsec / 1000000;
-	if (ms < 0) ms = 0;
-	return (DWORD)ms;
+	InterlockedExchange(&pool->_Stop, 1);
+	for (int i = 0; i < count; i++)
+		_Smph_post(&pool->_Wake);
+	for (int i = 0; i < count; i++)
+		thrd_join(pool->_Workers[i]._Thread, NULL);
 }
 
-int __cdecl thrd_sleep(_In_ const struct timespec* duration, struct timespec* remaining)
+int __cdecl thrd_pool_create(_Out_ thrd_pool_t* pool, int workers)
 {
-	struct timespec t1;
-	if (!timespec_get(&t1, TIME_UTC)) remaining = NULL;
-	DWORD r = SleepEx(_Timespec_ms(duration), TRUE);
-	if (!r) return 0;
-	if (remaining)
+	*pool = NULL;
+	if (workers <= 0)
+		workers = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	struct _Thrd_pool* p = calloc(1, sizeof(struct _Thrd_pool));
+	if (!p) return thrd_nomem;
+	p->_Workers = calloc((size_t)workers, sizeof(_Pool_worker));
+	if (!p->_Workers)
 	{
-		struct timespec t2;
-		if (timespec_get(&t2, TIME_UTC))
+		free(p);
+		return thrd_nomem;
+	}
+	p->_Count = workers;
+	_Smph_init(&p->_Wake, workers, 0);
+	for (int i = 0; i < workers; i++)
+	{
+		_Pool_worker* worker = &p->_Workers[i];
+		worker->_Array = _Pool_array_new(_POOL_INIT_CAPACITY);
+		if (!worker->_Array)
+		{
+			_Pool_free(p);
+			return thrd_nomem;
+		}
+		worker->_Pool = p;
+		worker->_Seed = (unsigned int)i + 1;
+	}
+	for (int i = 0; i < workers; i++)
+	{
+		int r = thrd_create(&p->_Workers[i]._Thread, _Pool_worker_main, &p->_Workers[i]);
+		if (r)
 		{
-			remaining->tv_sec = t2.tv_sec - t1.tv_sec - duration->tv_sec;
-			remaining->tv_nsec = t2.tv_nsec - t1.tv_nsec - duration->tv_nsec;
-			_Timespec_setvalid(remaining);
+			_Pool_stop(p, i);
+			_Pool_free(p);
+			return r;
 		}
 	}
-	return r == WAIT_IO_COMPLETION ? -1 : -2;
+	*pool = p;
+	return thrd_success;
 }
 
-void __cdecl thrd_yield(void)
+static int _Pool_submit_impl(_In_ struct _Thrd_pool* pool, _In_ thrd_task_t func, _In_reads_(count) void* const* args, size_t count)
 {
-	Sleep(0);
+	if (!count) return thrd_success;
+	InterlockedExchangeAdd(&pool->_Pending, (LONG)count);
+	_Pool_worker* worker = _Pool_current;
+	size_t pushed = 0;
+	int r = thrd_success;
+	if (worker && worker->_Pool == pool)
+	{
+		// Submitted by a task, push to the own deque.
+		for (; pushed < count; pushed++)
+		{
+			_Pool_task task;
+			task._Func = func;
+			task._Arg = args[pushed];
+			r = _Pool_push(worker, &task);
+			if (r) break;
+		}
+	}
+	else
+	{
+		r = _Pool_enqueue(&pool->_Queue, func, args, count);
+		if (!r) pushed = count;
+	}
+	if (pushed < count)
+	{
+		if (InterlockedExchangeAdd(&pool->_Pending, -(LONG)(count - pushed)) == (LONG)(count - pushed))
+			_Pool_signal(pool);
+	}
+	if (pushed) _Pool_notify(pool, pushed);
+	return r;
 }
 
-noreturn void __cdecl thrd_exit(_In_ int res)
+int __cdecl thrd_pool_submit(_In_ thrd_pool_t pool, _In_ thrd_task_t func, _In_opt_ void* arg)
 {
-	// Clear all data before exit
-	_Tss_clear_all();
-	_endthreadex((unsigned)res);
+	return _Pool_submit_impl(pool, func, &arg, 1);
 }
 
-int __cdecl thrd_detach(_In_ thrd_t thr)
+int __cdecl thrd_pool_submit_n(_In_ thrd_pool_t pool, _In_ thrd_task_t func, _In_reads_(count) void* const* args, size_t count)
 {
-	if (CloseHandle(thr))
-		return thrd_success;
-	else
-		return thrd_error;
+	return _Pool_submit_impl(pool, func, args, count);
 }
 
-int __cdecl thrd_join(_In_ thrd_t thr, int* res)
+int __cdecl thrd_pool_wait(_In_ thrd_pool_t pool)
 {
-	if (WaitForSingleObject(thr, INFINITE) == WAIT_FAILED)
-		return thrd_error;
-	if (res)
+	_Pool_worker* worker = _Pool_current;
+	// A task waiting for itself never completes.
+	if (worker && worker->_Pool == pool) return thrd_error;
+	InterlockedIncrement(&pool->_Waiters);
+	for (;;)
 	{
-		DWORD dres;
-		if (GetExitCodeThread(thr, &dres))
-			*res = (int)dres;
+		// Read before checking, so that a later submission or completion wakes us.
+		LONG signal = ReadAcquire(&pool->_Signal);
+		if (!ReadAcquire(&pool->_Pending)) break;
+		_Pool_task task;
+		if (_Pool_find_task(pool, NULL, &task))
+			_Pool_run(pool, &task);
 		else
-			return thrd_error;
+			_Atomic_wait(&pool->_Signal, signal, _NO_DEADLINE);
 	}
-	return thrd_detach(thr);
+	InterlockedDecrement(&pool->_Waiters);
+	return thrd_success;
 }
 
-int __cdecl mtx_init(_Out_ mtx_t* mutex, _In_ int type)
+void __cdecl thrd_pool_destroy(_In_ thrd_pool_t pool)
 {
-	mutex->recursive = type & mtx_recursive;
-	mutex->basetype = type & (~mtx_recursive);
-	mutex->locked = false;
-	switch (mutex->basetype)
-	{
-	case mtx_plain:
-		InitializeCriticalSection(&mutex->obj.cs);
-		break;
-	case _Mtx_shared:
-		InitializeSRWLock(&mutex->obj.shared);
-		break;
-	case mtx_timed:
-		mutex->obj.mutex = CreateMutex(NULL, FALSE, NULL);
-		if (!mutex->obj.mutex)
-			return thrd_error;
-		break;
-	}
-	return thrd_success;
+	thrd_pool_wait(pool);
+	_Pool_stop(pool, pool->_Count);
+	_Pool_free(pool);
 }
 
-static int _Mtx_non_recursive_lock(_In_ mtx_t* mutex)
+// A cell of the ring buffer.
+// The sequence tells whose turn it is: pos for the sender, pos + 1 for the receiver.
+typedef struct
 {
-	if (!mutex->recursive)
-	{
-		while (mutex->locked) Sleep(1);
-	}
-	mutex->locked = true;
-	return thrd_success;
-}
+	volatile LONG64 _Seq;
+	void* _Value;
+} _Chan_slot;
 
-int __cdecl mtx_lock(_In_ mtx_t* mutex)
+struct _Thrd_chan
 {
-	switch (mutex->basetype)
-	{
-	case mtx_plain:
-		EnterCriticalSection(&mutex->obj.cs);
-		break;
-	case _Mtx_shared:
-		AcquireSRWLockExclusive(&mutex->obj.shared);
-		break;
-	case mtx_timed:
-		if (WaitForSingleObject(mutex->obj.mutex, INFINITE))
-			return thrd_error;
-		break;
-	}
-	return _Mtx_non_recursive_lock(mutex);
-}
+	volatile LONG64 _Send;
+	char _Pad0[_CACHE_LINE - sizeof(LONG64)];
+	volatile LONG64 _Recv;
+	char _Pad1[_CACHE_LINE - sizeof(LONG64)];
+	// Signaled when the channel is not empty
+	thrd_eventcount_t _Readable;
+	char _Pad2[_CACHE_LINE - sizeof(thrd_eventcount_t)];
+	// Signaled when the channel is not full
+	thrd_eventcount_t _Writable;
+	char _Pad3[_CACHE_LINE - sizeof(thrd_eventcount_t)];
+	LONG64 _Mask;
+};
 
-int __cdecl _Mtx_slock(_In_ mtx_t* mutex)
+#define _Chan_slots(chan) ((_Chan_slot*)((chan) + 1))
+
+int __cdecl thrd_chan_create(_Out_ thrd_chan_t* chan, size_t capacity)
 {
-	if (mutex->basetype != _Mtx_shared) return thrd_error;
-	AcquireSRWLockShared(&mutex->obj.shared);
+	*chan = NULL;
+	if (!capacity || capacity > ((size_t)1 << 30)) return thrd_error;
+	// At least 2, so that a slot never holds the sequences of both sides.
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+	struct _Thrd_chan* c = calloc(1, sizeof(struct _Thrd_chan) + size * sizeof(_Chan_slot));
+	if (!c) return thrd_nomem;
+	c->_Mask = (LONG64)size - 1;
+	for (size_t i = 0; i < size; i++)
+		_Chan_slots(c)[i]._Seq = (LONG64)i;
+	*chan = c;
 	return thrd_success;
 }
 
-int __cdecl mtx_timedlock(_In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+static bool _Chan_trysend(_In_ struct _Thrd_chan* chan, void* value)
 {
-	if (mutex->basetype != mtx_timed) return thrd_error;
-	struct timespec span = _Timespec_duration(time_point);
-	DWORD r = WaitForSingleObject(mutex->obj.mutex, _Timespec_ms(&span));
-	if (r)
+	LONG64 pos = ReadNoFence64(&chan->_Send);
+	for (;;)
 	{
-		if (r == WAIT_TIMEOUT)
-			return thrd_timedout;
+		_Chan_slot* slot = &_Chan_slots(chan)[pos & chan->_Mask];
+		LONG64 diff = ReadAcquire64(&slot->_Seq) - pos;
+		if (diff == 0)
+		{
+			LONG64 prev = InterlockedCompareExchange64(&chan->_Send, pos + 1, pos);
+			if (prev == pos)
+			{
+				slot->_Value = value;
+				WriteRelease64(&slot->_Seq, pos + 1);
+				return true;
+			}
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			// The receiver of the last round has not taken it.
+			return false;
+		}
 		else
-			return thrd_error;
+		{
+			pos = ReadNoFence64(&chan->_Send);
+		}
 	}
-	return _Mtx_non_recursive_lock(mutex);
 }
 
-int __cdecl mtx_trylock(_In_ mtx_t* mutex)
+static bool _Chan_tryrecv(_In_ struct _Thrd_chan* chan, _Out_ void** value)
 {
-	if (!mutex->recursive && mutex->locked)
+	LONG64 pos = ReadNoFence64(&chan->_Recv);
+	for (;;)
 	{
-		return thrd_busy;
-	}
-	int r = thrd_success;
-	switch (mutex->basetype)
-	{
-	case mtx_plain:
-		if (!TryEnterCriticalSection(&mutex->obj.cs)) r = thrd_busy;
-		break;
-	case _Mtx_shared:
-		if (!TryAcquireSRWLockExclusive(&mutex->obj.shared)) r = thrd_busy;
-		break;
-	case mtx_timed:
-		if (WaitForSingleObject(mutex->obj.mutex, 0)) r = thrd_busy;
-		break;
+		_Chan_slot* slot = &_Chan_slots(chan)[pos & chan->_Mask];
+		LONG64 diff = ReadAcquire64(&slot->_Seq) - (pos + 1);
+		if (diff == 0)
+		{
+			LONG64 prev = InterlockedCompareExchange64(&chan->_Recv, pos + 1, pos);
+			if (prev == pos)
+			{
+				*value = slot->_Value;
+				// Ready for the sender of the next round.
+				WriteRelease64(&slot->_Seq, pos + chan->_Mask + 1);
+				return true;
+			}
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			// The sender has not filled it.
+			return false;
+		}
+		else
+		{
+			pos = ReadNoFence64(&chan->_Recv);
+		}
 	}
-	if (!r) mutex->locked = true;
-	return r;
 }
 
-int __cdecl _Mtx_tryslock(_In_ mtx_t* mutex)
+static int _Chan_send_impl(_In_ struct _Thrd_chan* chan, void* value, LONGLONG deadline)
 {
-	if (mutex->basetype != _Mtx_shared) return thrd_error;
-	if (TryAcquireSRWLockShared(&mutex->obj.shared))
-		return thrd_success;
-	else
-		return thrd_busy;
+	while (!_Chan_trysend(chan, value))
+	{
+		LONG epoch = _Eventcount_prepare(&chan->_Writable);
+		if (_Chan_trysend(chan, value))
+		{
+			thrd_eventcount_cancel_wait(&chan->_Writable);
+			break;
+		}
+		if (!_Eventcount_wait(&chan->_Writable, epoch, deadline)) return thrd_timedout;
+	}
+	_Eventcount_notify(&chan->_Readable, false);
+	return thrd_success;
 }
 
-int __cdecl mtx_unlock(_In_ mtx_t* mutex)
+static int _Chan_recv_impl(_In_ struct _Thrd_chan* chan, _Out_ void** value, LONGLONG deadline)
 {
-	mutex->locked = false;
-	switch (mutex->basetype)
+	while (!_Chan_tryrecv(chan, value))
 	{
-	case mtx_plain:
-		LeaveCriticalSection(&mutex->obj.cs);
-		break;
-	case _Mtx_shared:
-		ReleaseSRWLockExclusive(&mutex->obj.shared);
-		break;
-	case mtx_timed:
-		if (!ReleaseMutex(mutex->obj.mutex))
-			return thrd_error;
-		break;
+		LONG epoch = _Eventcount_prepare(&chan->_Readable);
+		if (_Chan_tryrecv(chan, value))
+		{
+			thrd_eventcount_cancel_wait(&chan->_Readable);
+			break;
+		}
+		if (!_Eventcount_wait(&chan->_Readable, epoch, deadline)) return thrd_timedout;
 	}
+	_Eventcount_notify(&chan->_Writable, false);
 	return thrd_success;
 }
 
-int __cdecl _Mtx_sunlock(_In_ mtx_t* mutex)
+int __cdecl thrd_chan_send(_In_ thrd_chan_t chan, _In_opt_ void* value)
 {
-	if (mutex->basetype != _Mtx_shared) return thrd_error;
-	ReleaseSRWLockShared(&mutex->obj.shared);
-	return thrd_success;
+	return _Chan_send_impl(chan, value, _NO_DEADLINE);
 }
 
-void __cdecl mtx_destroy(_In_ mtx_t* mutex)
+int __cdecl thrd_chan_trysend(_In_ thrd_chan_t chan, _In_opt_ void* value)
 {
-	switch (mutex->basetype)
-	{
-	case mtx_plain:
-		DeleteCriticalSection(&mutex->obj.cs);
-		break;
-	case mtx_timed:
-	{
-		BOOL r = CloseHandle(mutex->obj.mutex);
-		assert(r);
-		break;
-	}
-	}
+	if (!_Chan_trysend(chan, value)) return thrd_busy;
+	_Eventcount_notify(&chan->_Readable, false);
+	return thrd_success;
 }
 
-static BOOL WINAPI _Init_once_callback(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+int __cdecl thrd_chan_timedsend(_In_ thrd_chan_t chan, _In_opt_ void* value, _In_ const struct timespec* time_point)
 {
-	// Ignore some params
-	(void)initOnce;
-	(void)context;
-	// Call the function
-	void (*func)(void) = (void (*)(void))parameter;
-	func();
-	return TRUE;
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Chan_send_impl(chan, value, deadline);
 }
 
-void __cdecl call_once(_In_ once_flag* flag, _In_ void(__cdecl* func)(void))
+int __cdecl thrd_chan_send_n(_In_ thrd_chan_t chan, _In_reads_(count) void* const* values, size_t count)
 {
-	BOOL r = InitOnceExecuteOnce((PINIT_ONCE)flag, _Init_once_callback, (void*)func, NULL);
-	assert(r);
+	size_t sent = 0;
+	for (;;)
+	{
+		size_t batch = sent;
+		while (sent < count && _Chan_trysend(chan, values[sent])) sent++;
+		// Wake the receivers once for the whole batch.
+		if (sent > batch) _Eventcount_notify(&chan->_Readable, sent - batch > 1);
+		if (sent == count) return thrd_success;
+		LONG epoch = _Eventcount_prepare(&chan->_Writable);
+		if (_Chan_trysend(chan, values[sent]))
+		{
+			thrd_eventcount_cancel_wait(&chan->_Writable);
+			_Eventcount_notify(&chan->_Readable, false);
+			sent++;
+		}
+		else
+		{
+			_Eventcount_wait(&chan->_Writable, epoch, _NO_DEADLINE);
+		}
+	}
 }
 
-int __cdecl cnd_init(_Out_ cnd_t* cond)
+int __cdecl thrd_chan_recv(_In_ thrd_chan_t chan, _Out_ void** value)
 {
-	InitializeConditionVariable(&cond->cv);
-	InitializeCriticalSection(&cond->cs);
-	return thrd_success;
+	return _Chan_recv_impl(chan, value, _NO_DEADLINE);
 }
 
-int __cdecl cnd_signal(_In_ cnd_t* cond)
+int __cdecl thrd_chan_tryrecv(_In_ thrd_chan_t chan, _Out_ void** value)
 {
-	WakeConditionVariable(&cond->cv);
+	if (!_Chan_tryrecv(chan, value)) return thrd_busy;
+	_Eventcount_notify(&chan->_Writable, false);
 	return thrd_success;
 }
 
-int __cdecl cnd_broadcast(_In_ cnd_t* cond)
+int __cdecl thrd_chan_timedrecv(_In_ thrd_chan_t chan, _Out_ void** value, _In_ const struct timespec* time_point)
 {
-	WakeAllConditionVariable(&cond->cv);
-	return thrd_success;
+	LONGLONG deadline;
+	if (!_Deadline_from(time_point, TIME_UTC, &deadline)) return thrd_error;
+	return _Chan_recv_impl(chan, value, deadline);
 }
 
-static int _Cnd_wait_impl(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, DWORD ms)
+int __cdecl thrd_chan_recv_n(_In_ thrd_chan_t chan, _Out_writes_to_(count, *received) void** values, size_t count, _Out_ size_t* received)
 {
-	bool usemutex = mutex->basetype == mtx_timed || !mutex->recursive;
-	if (usemutex)
-	{
-		if (mtx_unlock(mutex)) return thrd_error;
-		EnterCriticalSection(&cond->cs);
-	}
-	bool succeed;
-	if (mutex->basetype != _Mtx_shared || usemutex)
-	{
-		succeed = SleepConditionVariableCS(&cond->cv, usemutex ? &cond->cs : &mutex->obj.cs, ms);
-	}
-	else
-	{
-		succeed = SleepConditionVariableSRW(&cond->cv, &mutex->obj.shared, ms, 0);
-	}
-	int ret;
-	if (succeed)
-		ret = thrd_success;
-	else
+	size_t n = 0;
+	while (count)
 	{
-		DWORD r = GetLastError();
-		if (r == ERROR_TIMEOUT)
-			ret = thrd_timedout;
+		while (n < count && _Chan_tryrecv(chan, &values[n])) n++;
+		if (n) break;
+		LONG epoch = _Eventcount_prepare(&chan->_Readable);
+		if (_Chan_tryrecv(chan, &values[n]))
+		{
+			thrd_eventcount_cancel_wait(&chan->_Readable);
+			n++;
+		}
 		else
-			ret = thrd_error;
-	}
-	if (usemutex)
-	{
-		LeaveCriticalSection(&cond->cs);
-		if (mtx_lock(mutex)) return thrd_error;
+		{
+			_Eventcount_wait(&chan->_Readable, epoch, _NO_DEADLINE);
+		}
 	}
-	return ret;
+	// Wake the senders once for the whole batch.
+	if (n) _Eventcount_notify(&chan->_Writable, n > 1);
+	*received = n;
+	return thrd_success;
 }
 
-int __cdecl cnd_wait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex)
+void __cdecl thrd_chan_destroy(_In_ thrd_chan_t chan)
 {
-	return _Cnd_wait_impl(cond, mutex, INFINITE);
+	assert(!chan->_Readable.waiters && !chan->_Writable.waiters);
+	free(chan);
 }
 
-int __cdecl cnd_timedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+struct _Thrd_spsc
 {
-	struct timespec span = _Timespec_duration(time_point);
-	return _Cnd_wait_impl(cond, mutex, _Timespec_ms(&span));
-}
+	// Written by the producer only, with its copy of the head.
+	volatile LONG64 _Tail;
+	LONG64 _Head_cache;
+	char _Pad0[_CACHE_LINE - 2 * sizeof(LONG64)];
+	// Written by the consumer only, with its copy of the tail.
+	volatile LONG64 _Head;
+	LONG64 _Tail_cache;
+	char _Pad1[_CACHE_LINE - 2 * sizeof(LONG64)];
+	// Signaled when the queue is not empty
+	thrd_eventcount_t _Readable;
+	char _Pad2[_CACHE_LINE - sizeof(thrd_eventcount_t)];
+	// Signaled when the queue is not full
+	thrd_eventcount_t _Writable;
+	char _Pad3[_CACHE_LINE - sizeof(thrd_eventcount_t)];
+	LONG64 _Mask;
+	size_t _Elem_size;
+	char* _Buffer;
+};
 
-static int __cdecl _Cnd_swait_impl(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, DWORD ms)
+// Times to spin before preparing to park
+#define _SPSC_SPIN_COUNT 256
+
+int __cdecl thrd_spsc_create(_Out_ thrd_spsc_t* queue, size_t capacity, size_t elem_size)
 {
-	if (mutex->basetype != _Mtx_shared) return thrd_error;
-	if (SleepConditionVariableSRW(&cond->cv, &mutex->obj.shared, ms, CONDITION_VARIABLE_LOCKMODE_SHARED))
-		return thrd_success;
-	else
+	*queue = NULL;
+	if (!capacity || !elem_size || capacity > ((size_t)1 << 30)) return thrd_error;
+	size_t size = 1;
+	while (size < capacity) size <<= 1;
+	if (elem_size > SIZE_MAX / size) return thrd_error;
+	struct _Thrd_spsc* q = calloc(1, sizeof(struct _Thrd_spsc));
+	if (!q) return thrd_nomem;
+	q->_Buffer = malloc(size * elem_size);
+	if (!q->_Buffer)
 	{
-		DWORD r = GetLastError();
-		if (r == ERROR_TIMEOUT)
-			return thrd_timedout;
-		else
-			return thrd_error;
+		free(q);
+		return thrd_nomem;
 	}
+	q->_Mask = (LONG64)size - 1;
+	q->_Elem_size = elem_size;
+	*queue = q;
+	return thrd_success;
 }
 
-int __cdecl _Cnd_swait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex)
-{
-	return _Cnd_swait_impl(cond, mutex, INFINITE);
-}
-
-int __cdecl _Cnd_stimedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point)
+// Free slots seen by the producer, refreshing the head only if it looks full.
+static LONG64 _Spsc_space(_In_ struct _Thrd_spsc* q, LONG64 tail)
 {
-	struct timespec span = _Timespec_duration(time_point);
-	return _Cnd_swait_impl(cond, mutex, _Timespec_ms(&span));
+	LONG64 space = q->_Mask + 1 - (tail - q->_Head_cache);
+	if (space) return space;
+	q->_Head_cache = ReadAcquire64(&q->_Head);
+	return q->_Mask + 1 - (tail - q->_Head_cache);
 }
 
-void __cdecl cnd_destroy(_In_ cnd_t* cond)
+// Elements seen by the consumer, refreshing the tail only if it looks empty.
+static LONG64 _Spsc_avail(_In_ struct _Thrd_spsc* q, LONG64 head)
 {
-	DeleteCriticalSection(&cond->cs);
+	LONG64 avail = q->_Tail_cache - head;
+	if (avail) return avail;
+	q->_Tail_cache = ReadAcquire64(&q->_Tail);
+	return q->_Tail_cache - head;
 }
 
-int __cdecl _Smph_init(_Out_ _Smph_t* sem, int max_count, int count)
+static LONG64 _Spsc_wait_space(_In_ struct _Thrd_spsc* q, LONG64 tail)
 {
-	*sem = CreateSemaphore(NULL, count, max_count, NULL);
-	if (*sem)
-		return thrd_success;
-	else
-		return thrd_error;
+	LONG64 space;
+	for (int i = 0; i < _SPSC_SPIN_COUNT; i++)
+	{
+		if ((space = _Spsc_space(q, tail)) != 0) return space;
+		YieldProcessor();
+	}
+	for (;;)
+	{
+		LONG epoch = _Eventcount_prepare(&q->_Writable);
+		if ((space = _Spsc_space(q, tail)) != 0)
+		{
+			thrd_eventcount_cancel_wait(&q->_Writable);
+			return space;
+		}
+		_Eventcount_wait(&q->_Writable, epoch, _NO_DEADLINE);
+	}
 }
 
-static int _Smph_wait_impl(_In_ _Smph_t* sem, DWORD ms)
+static LONG64 _Spsc_wait_avail(_In_ struct _Thrd_spsc* q, LONG64 head)
 {
-	DWORD r = WaitForSingleObject(*sem, ms);
-	if (!r)
-		return thrd_success;
-	else
+	LONG64 avail;
+	for (int i = 0; i < _SPSC_SPIN_COUNT; i++)
 	{
-		if (r == WAIT_TIMEOUT)
-			return thrd_timedout;
-		else
-			return thrd_error;
+		if ((avail = _Spsc_avail(q, head)) != 0) return avail;
+		YieldProcessor();
+	}
+	for (;;)
+	{
+		LONG epoch = _Eventcount_prepare(&q->_Readable);
+		if ((avail = _Spsc_avail(q, head)) != 0)
+		{
+			thrd_eventcount_cancel_wait(&q->_Readable);
+			return avail;
+		}
+		_Eventcount_wait(&q->_Readable, epoch, _NO_DEADLINE);
 	}
 }
 
-int __cdecl _Smph_wait(_In_ _Smph_t* sem)
+static void* _Spsc_slot(_In_ struct _Thrd_spsc* q, LONG64 pos)
 {
-	return _Smph_wait_impl(sem, INFINITE);
+	return q->_Buffer + (size_t)(pos & q->_Mask) * q->_Elem_size;
 }
 
-int __cdecl _Smph_timedwait(_In_ _Smph_t* restrict sem, _In_ const struct timespec* restrict time_point)
+int __cdecl thrd_spsc_push(_In_ thrd_spsc_t queue, _In_ const void* elem)
 {
-	struct timespec span = _Timespec_duration(time_point);
-	return _Smph_wait_impl(sem, _Timespec_ms(&span));
+	LONG64 tail = ReadNoFence64(&queue->_Tail);
+	_Spsc_wait_space(queue, tail);
+	memcpy(_Spsc_slot(queue, tail), elem, queue->_Elem_size);
+	WriteRelease64(&queue->_Tail, tail + 1);
+	_Eventcount_notify(&queue->_Readable, false);
+	return thrd_success;
 }
 
-int __cdecl _Smph_trywait(_In_ _Smph_t* sem)
+int __cdecl thrd_spsc_trypush(_In_ thrd_spsc_t queue, _In_ const void* elem)
 {
-	return _Smph_wait_impl(sem, 0);
+	LONG64 tail = ReadNoFence64(&queue->_Tail);
+	if (!_Spsc_space(queue, tail)) return thrd_busy;
+	memcpy(_Spsc_slot(queue, tail), elem, queue->_Elem_size);
+	WriteRelease64(&queue->_Tail, tail + 1);
+	_Eventcount_notify(&queue->_Readable, false);
+	return thrd_success;
 }
 
-int __cdecl _Smph_post(_In_ _Smph_t* sem)
+int __cdecl thrd_spsc_pop(_In_ thrd_spsc_t queue, _Out_ void* elem)
 {
-	return _Smph_multipost(sem, 1);
+	LONG64 head = ReadNoFence64(&queue->_Head);
+	_Spsc_wait_avail(queue, head);
+	memcpy(elem, _Spsc_slot(queue, head), queue->_Elem_size);
+	WriteRelease64(&queue->_Head, head + 1);
+	_Eventcount_notify(&queue->_Writable, false);
+	return thrd_success;
 }
 
-int __cdecl _Smph_multipost(_In_ _Smph_t* sem, int count)
+int __cdecl thrd_spsc_trypop(_In_ thrd_spsc_t queue, _Out_ void* elem)
 {
-	if (ReleaseSemaphore(*sem, count, NULL))
-		return thrd_success;
-	else
-		return thrd_error;
+	LONG64 head = ReadNoFence64(&queue->_Head);
+	if (!_Spsc_avail(queue, head)) return thrd_busy;
+	memcpy(elem, _Spsc_slot(queue, head), queue->_Elem_size);
+	WriteRelease64(&queue->_Head, head + 1);
+	_Eventcount_notify(&queue->_Writable, false);
+	return thrd_success;
 }
 
-typedef struct _SEMAPHORE_BASIC_INFORMATION
+int __cdecl thrd_spsc_reserve(_In_ thrd_spsc_t queue, size_t count, _Out_ void** slots, _Out_ size_t* reserved)
 {
-	ULONG CurrentCount;
-	ULONG MaximumCount;
-
-} SEMAPHORE_BASIC_INFORMATION, * PSEMAPHORE_BASIC_INFORMATION;
+	*slots = NULL;
+	*reserved = 0;
+	if (!count) return thrd_success;
+	LONG64 tail = ReadNoFence64(&queue->_Tail);
+	LONG64 n = _Spsc_wait_space(queue, tail);
+	// Not across the end of the buffer.
+	LONG64 contiguous = queue->_Mask + 1 - (tail & queue->_Mask);
+	if (n > contiguous) n = contiguous;
+	if ((size_t)n > count) n = (LONG64)count;
+	*slots = _Spsc_slot(queue, tail);
+	*reserved = (size_t)n;
+	return thrd_success;
+}
 
-typedef enum _SEMAPHORE_INFORMATION_CLASS
+int __cdecl thrd_spsc_commit(_In_ thrd_spsc_t queue, size_t count)
 {
-	SemaphoreBasicInformation
-} SEMAPHORE_INFORMATION_CLASS;
+	LONG64 tail = ReadNoFence64(&queue->_Tail);
+	if ((LONG64)count > queue->_Mask + 1 - (tail - queue->_Head_cache)) return thrd_error;
+	if (!count) return thrd_success;
+	WriteRelease64(&queue->_Tail, tail + (LONG64)count);
+	_Eventcount_notify(&queue->_Readable, false);
+	return thrd_success;
+}
 
-NTSYSAPI NTSTATUS NTAPI NtQuerySemaphore(IN HANDLE SemaphoreHandle, IN SEMAPHORE_INFORMATION_CLASS SemaphoreInformationClass, OUT PVOID SemaphoreInformation, IN ULONG SemaphoreInformationLength, OUT PULONG ReturnLength OPTIONAL);
+int __cdecl thrd_spsc_acquire(_In_ thrd_spsc_t queue, size_t count, _Out_ void** slots, _Out_ size_t* acquired)
+{
+	*slots = NULL;
+	*acquired = 0;
+	if (!count) return thrd_success;
+	LONG64 head = ReadNoFence64(&queue->_Head);
+	LONG64 n = _Spsc_wait_avail(queue, head);
+	// Not across the end of the buffer.
+	LONG64 contiguous = queue->_Mask + 1 - (head & queue->_Mask);
+	if (n > contiguous) n = contiguous;
+	if ((size_t)n > count) n = (LONG64)count;
+	*slots = _Spsc_slot(queue, head);
+	*acquired = (size_t)n;
+	return thrd_success;
+}
 
-int __cdecl _Smph_get(_In_ _Smph_t* restrict sem, int* restrict count)
+int __cdecl thrd_spsc_release(_In_ thrd_spsc_t queue, size_t count)
 {
-	SEMAPHORE_BASIC_INFORMATION info;
-	ULONG len;
-	NTSTATUS r = NtQuerySemaphore(*sem, SemaphoreBasicInformation, &info, sizeof(SEMAPHORE_BASIC_INFORMATION), &len);
-	if (r != ERROR_SUCCESS) return thrd_error;
-	if (count) *count = info.CurrentCount;
+	LONG64 head = ReadNoFence64(&queue->_Head);
+	if ((LONG64)count > queue->_Tail_cache - head) return thrd_error;
+	if (!count) return thrd_success;
+	WriteRelease64(&queue->_Head, head + (LONG64)count);
+	_Eventcount_notify(&queue->_Writable, false);
 	return thrd_success;
 }
 
-void __cdecl _Smph_destroy(_In_ _Smph_t* sem)
+void __cdecl thrd_spsc_destroy(_In_ thrd_spsc_t queue)
 {
-	BOOL r = CloseHandle(*sem);
-	assert(r);
+	assert(!queue->_Readable.waiters && !queue->_Writable.waiters);
+	free(queue->_Buffer);
+	free(queue);
 }
 
 int __cdecl tss_create(_Out_ tss_t* tss_key, _In_opt_ tss_dtor_t destructor)
 {
-	*tss_key = TlsAlloc();
-	if (*tss_key == TLS_OUT_OF_INDEXES)
-		return thrd_error;
+	_Mtx_word_lock(&_Tss_keys_lock);
+	DWORD index;
+	if (_Tss_free_head)
+	{
+		index = _Tss_free_head - 1;
+		_Tss_free_head = _Tss_keys[index]._Next_free;
+	}
 	else
 	{
-		assert(*tss_key < _DTORS_COUNT);
-		_Dtors[*tss_key] = destructor;
-		if (destructor) _Add_dtor_id(*tss_key);
-		return thrd_success;
+		if (_Tss_keys_count == _Tss_keys_capacity)
+		{
+			DWORD capacity = _Tss_keys_capacity ? _Tss_keys_capacity * 2 : 64;
+			_Tss_key_entry* keys = realloc(_Tss_keys, capacity * sizeof(_Tss_key_entry));
+			if (!keys)
+			{
+				_Mtx_word_unlock(&_Tss_keys_lock);
+				return thrd_nomem;
+			}
+			_Tss_keys = keys;
+			_Tss_keys_capacity = capacity;
+		}
+		index = _Tss_keys_count++;
+		// Generation 0 never matches, as it is the value of empty slots.
+		_Tss_keys[index]._Gen = 1;
 	}
+	_Tss_keys[index]._Dtor = destructor;
+	_Tss_keys[index]._Next_free = 0;
+	*tss_key = ((tss_t)_Tss_keys[index]._Gen << 32) | index;
+	_Mtx_word_unlock(&_Tss_keys_lock);
+	return thrd_success;
 }
 
 void* __cdecl tss_get(tss_t tss_key)
 {
-	return TlsGetValue(tss_key);
+	DWORD index = _Tss_index(tss_key);
+	if (index < _Tss_slots_capacity && _Tss_slots[index]._Gen == _Tss_gen(tss_key))
+		return _Tss_slots[index]._Value;
+	return NULL;
 }
 
 int __cdecl tss_set(tss_t tss_id, _In_opt_ void* val)
 {
-	if (TlsSetValue(tss_id, val))
-		return thrd_success;
-	else
-		return thrd_error;
+	DWORD index = _Tss_index(tss_id);
+	if (index >= _Tss_slots_capacity)
+	{
+		// Not set yet, no need to grow for NULL.
+		if (!val) return thrd_success;
+		DWORD capacity = _Tss_slots_capacity ? _Tss_slots_capacity : 16;
+		while (capacity <= index) capacity *= 2;
+		_Tss_slot* slots = realloc(_Tss_slots, capacity * sizeof(_Tss_slot));
+		if (!slots) return thrd_nomem;
+		memset(slots + _Tss_slots_capacity, 0, (capacity - _Tss_slots_capacity) * sizeof(_Tss_slot));
+		_Tss_slots = slots;
+		_Tss_slots_capacity = capacity;
+		_Thrd_exit_arm();
+	}
+	_Tss_slot* slot = &_Tss_slots[index];
+	if (val && !slot->_Pos)
+	{
+		if (_Tss_used_count == _Tss_used_capacity)
+		{
+			DWORD capacity = _Tss_used_capacity ? _Tss_used_capacity * 2 : 16;
+			DWORD* used = realloc(_Tss_used, capacity * sizeof(DWORD));
+			if (!used) return thrd_nomem;
+			_Tss_used = used;
+			_Tss_used_capacity = capacity;
+		}
+		_Tss_used[_Tss_used_count++] = index;
+		slot->_Pos = _Tss_used_count;
+	}
+	else if (!val && slot->_Pos)
+	{
+		_Tss_unlist(index);
+	}
+	slot->_Value = val;
+	slot->_Gen = _Tss_gen(tss_id);
+	return thrd_success;
 }
 
 void __cdecl tss_delete(tss_t tss_id)
 {
-	_Dtors[tss_id] = NULL;
-	BOOL r = TlsSetValue(tss_id, NULL);
-	assert(r);
-	r = TlsFree(tss_id);
-	assert(r);
+	DWORD index = _Tss_index(tss_id);
+	_Mtx_word_lock(&_Tss_keys_lock);
+	assert(index < _Tss_keys_count && _Tss_keys[index]._Gen == _Tss_gen(tss_id));
+	_Tss_key_entry* entry = &_Tss_keys[index];
+	entry->_Dtor = NULL;
+	if (!++entry->_Gen) entry->_Gen = 1;
+	entry->_Next_free = _Tss_free_head;
+	_Tss_free_head = index + 1;
+	_Mtx_word_unlock(&_Tss_keys_lock);
 }
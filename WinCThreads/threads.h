@@ -31,7 +31,10 @@
 #undef __STDC_NO_THREADS__
 #endif
 
-#ifdef WINCTHREADS_EXPOTRS
+// Define WINCTHREADS_STATIC to build or use the static library.
+#if defined(WINCTHREADS_STATIC) || !defined(_WIN32)
+#define THREADS_API
+#elif defined(WINCTHREADS_EXPOTRS)
 #define THREADS_API __declspec(dllexport)
 #else
 #define THREADS_API __declspec(dllimport)
@@ -47,8 +50,13 @@
 #define END_EXTERN_C
 #endif // __cplusplus
 
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include "threads_posix.h"
+#endif // _WIN32
 #include <stdbool.h>
+#include <stdio.h>
 #include <time.h>
 #include <stdnoreturn.h>
 
@@ -63,20 +71,80 @@ enum
 	thrd_error
 };
 
+// Time
+
+// The monotonic clock for the timed functions, as in C23
+#ifndef TIME_MONOTONIC
+#define TIME_MONOTONIC 2
+#endif // !TIME_MONOTONIC
+
+// Gets the current time of the base, TIME_UTC or TIME_MONOTONIC.
+// Returns base if succeeded, or 0.
+THREADS_API int __cdecl _Timespec_get(_Out_ struct timespec* ts, int base);
+
 // Thread
 
 typedef int(__cdecl* thrd_start_t)(void*);
 
-typedef HANDLE thrd_t;
+// The object of a thread created by the library, or of the calling thread for thrd_current.
+// It is not a HANDLE, unlike in the older versions.
+// The object of a thread not created by the library lives only as long as the thread.
+typedef struct _Thrd_obj* thrd_t;
 
 THREADS_API int __cdecl thrd_create(_Out_ thrd_t* thr, _In_ thrd_start_t func, _In_opt_ void* arg);
+
+// Priorities relative to the process, the same values as THREAD_PRIORITY_* of Windows.
+// On Linux they are nice values 5 apart from the creator's, and raising may need privileges.
+enum
+{
+	thrd_priority_lowest = -2,
+	thrd_priority_below_normal = -1,
+	thrd_priority_normal = 0,
+	thrd_priority_above_normal = 1,
+	thrd_priority_highest = 2
+};
+
+// Settings of a new thread, all applied before it runs the function.
+// Zero fields keep the defaults.
+typedef struct
+{
+	// Bytes of the stack reserved
+	size_t stack_size;
+	// Bytes of the guard below the stack, ignored on Windows where the system manages it
+	size_t guard_size;
+	// The CPUs to run on, numbered in the group
+	unsigned long long affinity;
+	// The processor group of affinity, 64 CPUs each on Linux
+	unsigned short group;
+	// The NUMA node to run on, or -1 for any; intersected with affinity if both are set
+	int numa_node;
+	// One of thrd_priority_*
+	int priority;
+	// The debug name in UTF-8, truncated to 15 bytes on Linux
+	const char* name;
+} thrd_attr_t;
+
+#define THRD_ATTR_INITIALIZER { 0, 0, 0, 0, -1, thrd_priority_normal, NULL }
+
+THREADS_API int __cdecl thrd_attr_init(_Out_ thrd_attr_t* attr);
+// Creates a thread with the settings, or as thrd_create if attr is NULL.
+// Returns thrd_error if any setting cannot be applied, and the function never runs.
+// Threads with settings are not kept in the cache of thrd_set_cache_limit.
+THREADS_API int __cdecl thrd_create_ex(_Out_ thrd_t* thr, _In_ thrd_start_t func, _In_opt_ void* arg, _In_opt_ const thrd_attr_t* attr);
 THREADS_API int __cdecl thrd_equal(_In_ thrd_t lhs, _In_ thrd_t rhs);
 THREADS_API thrd_t __cdecl thrd_current(void);
 THREADS_API int __cdecl thrd_sleep(_In_ const struct timespec* duration, struct timespec* remaining);
+// Sleeps until the time point of the base, TIME_UTC or TIME_MONOTONIC.
+THREADS_API int __cdecl _Thrd_clocksleep(int base, _In_ const struct timespec* time_point);
 THREADS_API void __cdecl thrd_yield(void);
 THREADS_API noreturn void __cdecl thrd_exit(_In_ int res);
+// Does nothing for a thread not created by the library.
 THREADS_API int __cdecl thrd_detach(_In_ thrd_t thr);
+// Returns thrd_error for a thread not created by the library, which has nothing to join.
 THREADS_API int __cdecl thrd_join(_In_ thrd_t thr, int* res);
+// Keeps at most limit finished threads parked, and thrd_create reuses them.
+// The limit is 0 by default, and threads exit when they finish.
+THREADS_API int __cdecl thrd_set_cache_limit(int limit);
 
 // Mutex
 
@@ -85,7 +153,18 @@ enum
 	mtx_plain = 0x1,
 	_Mtx_shared = 0x2,
 	mtx_timed = 0x3,
-	mtx_recursive = 0x4
+	mtx_recursive = 0x4,
+	// With _Mtx_shared, readers touch only their own slots,
+	// and writers drain all of them.
+	// New readers always wait while writers are waiting, and no policy below is accepted.
+	_Mtx_distributed = 0x8,
+	// Fairness policies of _Mtx_shared, phase-fair by default:
+	// readers that arrived during a writer enter before the next writer.
+	_Mtx_phase_fair = 0x0,
+	// New readers enter while writers are waiting.
+	_Mtx_prefer_readers = 0x10,
+	// New readers wait while writers are waiting.
+	_Mtx_prefer_writers = 0x20
 };
 
 #ifdef _MSC_VER
@@ -95,33 +174,186 @@ enum
 typedef struct
 {
 	union {
-		CRITICAL_SECTION cs;
-		HANDLE mutex;
-		SRWLOCK shared;
+		// The lock word of plain and timed mutexes:
+		// 0 for unlocked, 1 for locked, and 2 for locked with waiters.
+		volatile LONG word;
+		// The reader/writer state of shared mutexes
+		struct
+		{
+			// The lock word serializing the writers
+			volatile LONG lock;
+			// The count of readers, and the flags of writers
+			volatile LONG state;
+			// The count of readers waiting to enter
+			volatile LONG waiting;
+		} rw;
 	} obj;
+	// The id of the owner thread and the recursion depth,
+	// maintained only for recursive mutexes.
+	volatile DWORD owner;
+	unsigned int count;
+	// The bit fields fill the word after count.
 	unsigned int basetype : 2;
-	bool recursive : 1;
-	bool locked : 1;
+	unsigned int policy : 2;
+	unsigned int recursive : 1;
+	// Waiters moved here from a condition variable by cnd_broadcast,
+	// handed the mutex one by one as it is unlocked.
+	struct _Cnd_waiter* volatile morphed;
+	// The reader slots of a distributed shared mutex
+	struct _Mtx_readers* readers;
 } mtx_t;
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif // _MSC_VER
 
+// Initializes a mutex statically, the same as mtx_init with the type.
+// A zero-initialized mutex is a plain one.
+// Distributed mutexes allocate their slots, so they are not supported.
+#define MTX_INITIALIZER(type) { { 0 }, 0, 0, (type)&mtx_timed, ((type) >> 4) & 0x3, ((type)&mtx_recursive) != 0, NULL, NULL }
+
 THREADS_API int __cdecl mtx_init(_Out_ mtx_t* mutex, _In_ int type);
 THREADS_API int __cdecl mtx_lock(_In_ mtx_t* mutex);
 THREADS_API int __cdecl _Mtx_slock(_In_ mtx_t* mutex);
 THREADS_API int __cdecl mtx_timedlock(_In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point);
+THREADS_API int __cdecl _Mtx_clocklock(_In_ mtx_t* restrict mutex, int base, _In_ const struct timespec* restrict time_point);
 THREADS_API int __cdecl mtx_trylock(_In_ mtx_t* mutex);
 THREADS_API int __cdecl _Mtx_tryslock(_In_ mtx_t* mutex);
 THREADS_API int __cdecl mtx_unlock(_In_ mtx_t* mutex);
 THREADS_API int __cdecl _Mtx_sunlock(_In_ mtx_t* mutex);
+// Turns a shared lock into an exclusive one, without letting another writer in.
+// Returns thrd_busy if another reader is upgrading, and the lock is still shared.
+THREADS_API int __cdecl _Mtx_upgrade(_In_ mtx_t* mutex);
+// Upgrades only if the calling thread is the only reader, or returns thrd_busy.
+// A distributed mutex also returns thrd_busy while a writer holds the lock word.
+THREADS_API int __cdecl _Mtx_tryupgrade(_In_ mtx_t* mutex);
+// Turns an exclusive lock into a shared one, without letting another writer in.
+THREADS_API int __cdecl _Mtx_downgrade(_In_ mtx_t* mutex);
 THREADS_API void __cdecl mtx_destroy(_In_ mtx_t* mutex);
 
+// The size of a cache line
+#define _THRD_CACHE_LINE 64
+
+// A plain mutex in one word, for large arrays of locks.
+// It cannot be used with condition variables.
+typedef struct
+{
+	// 0 for unlocked, 1 for locked, and 2 for locked with waiters.
+	volatile LONG word;
+} _Mtx_compact_t;
+
+// A compact mutex alone in its cache line, for hot locks.
+typedef struct DECLSPEC_ALIGN(_THRD_CACHE_LINE)
+{
+	_Mtx_compact_t mutex;
+	char pad[_THRD_CACHE_LINE - sizeof(_Mtx_compact_t)];
+} _Mtx_padded_t;
+
+#define _MTX_COMPACT_INITIALIZER { 0 }
+#define _MTX_PADDED_INITIALIZER { _MTX_COMPACT_INITIALIZER, { 0 } }
+
+THREADS_API int __cdecl _Mtx_compact_init(_Out_ _Mtx_compact_t* mutex);
+THREADS_API int __cdecl _Mtx_compact_lock(_In_ _Mtx_compact_t* mutex);
+THREADS_API int __cdecl _Mtx_compact_timedlock(_In_ _Mtx_compact_t* restrict mutex, _In_ const struct timespec* restrict time_point);
+THREADS_API int __cdecl _Mtx_compact_trylock(_In_ _Mtx_compact_t* mutex);
+THREADS_API int __cdecl _Mtx_compact_unlock(_In_ _Mtx_compact_t* mutex);
+
+// A table of striped locks, each in its own cache line.
+// Objects are mapped to the stripes by their addresses or hashes.
+typedef struct _Thrd_lock_table* thrd_lock_table_t;
+
+// The count of stripes is rounded up to a power of 2.
+THREADS_API int __cdecl thrd_lock_table_create(_Out_ thrd_lock_table_t* table, size_t count);
+// Gets the stripe of the hash, which is mixed again to spread poor hashes.
+THREADS_API _Mtx_compact_t* __cdecl thrd_lock_table_get(_In_ thrd_lock_table_t table, size_t hash);
+// Gets the stripe of the object address.
+THREADS_API _Mtx_compact_t* __cdecl thrd_lock_table_get_addr(_In_ thrd_lock_table_t table, _In_ const void* addr);
+// Locks the stripes of two hashes in a fixed order, or once if they are the same stripe.
+THREADS_API int __cdecl thrd_lock_table_lock_pair(_In_ thrd_lock_table_t table, size_t hash1, size_t hash2);
+THREADS_API int __cdecl thrd_lock_table_unlock_pair(_In_ thrd_lock_table_t table, size_t hash1, size_t hash2);
+THREADS_API void __cdecl thrd_lock_table_destroy(_In_ thrd_lock_table_t table);
+
+// Spin locks
+// They never park the waiters, and fit critical sections too short for a mutex.
+
+// A test-and-test-and-set lock with exponential backoff.
+typedef struct
+{
+	volatile LONG locked;
+} thrd_spinlock_t;
+
+#define THRD_SPINLOCK_INITIALIZER { 0 }
+
+THREADS_API int __cdecl thrd_spinlock_init(_Out_ thrd_spinlock_t* lock);
+THREADS_API int __cdecl thrd_spinlock_lock(_In_ thrd_spinlock_t* lock);
+THREADS_API int __cdecl thrd_spinlock_trylock(_In_ thrd_spinlock_t* lock);
+THREADS_API int __cdecl thrd_spinlock_unlock(_In_ thrd_spinlock_t* lock);
+THREADS_API void __cdecl thrd_spinlock_destroy(_In_ thrd_spinlock_t* lock);
+
+// The queue node of a waiter of an MCS lock, owned by the caller
+// from lock to unlock, usually on its stack.
+// Each waiter spins on its own node, so the hand-off touches one cache line.
+typedef struct DECLSPEC_ALIGN(_THRD_CACHE_LINE) _Thrd_mcs_node
+{
+	struct _Thrd_mcs_node* volatile next;
+	volatile LONG locked;
+	char pad[_THRD_CACHE_LINE - sizeof(void*) - sizeof(LONG)];
+} thrd_mcs_node_t;
+
+// A queue lock, handing itself to the waiters in FIFO order.
+// A waiter parks after spinning a while, in case its thread is preempted,
+// but the hand-off still waits for it, so keep the threads within the processors.
+typedef struct
+{
+	thrd_mcs_node_t* volatile tail;
+} thrd_mcs_t;
+
+#define THRD_MCS_INITIALIZER { NULL }
+
+THREADS_API int __cdecl thrd_mcs_init(_Out_ thrd_mcs_t* lock);
+THREADS_API int __cdecl thrd_mcs_lock(_In_ thrd_mcs_t* restrict lock, _Out_ thrd_mcs_node_t* restrict node);
+THREADS_API int __cdecl thrd_mcs_trylock(_In_ thrd_mcs_t* restrict lock, _Out_ thrd_mcs_node_t* restrict node);
+// Unlocks with the same node as the lock.
+THREADS_API int __cdecl thrd_mcs_unlock(_In_ thrd_mcs_t* restrict lock, _In_ thrd_mcs_node_t* restrict node);
+THREADS_API void __cdecl thrd_mcs_destroy(_In_ thrd_mcs_t* lock);
+
+// Sequence lock
+// The readers never store, but retry if a writer has been inside,
+// thus they fit small data read much more often than written.
+
+typedef struct
+{
+	// Odd while a writer is inside.
+	volatile LONG seq;
+	// Serializes the writers.
+	volatile LONG lock;
+} thrd_seqlock_t;
+
+#define THRD_SEQLOCK_INITIALIZER { 0, 0 }
+
+THREADS_API int __cdecl thrd_seqlock_init(_Out_ thrd_seqlock_t* lock);
+// Waits for the writer inside, and returns the sequence to validate the reads.
+THREADS_API unsigned int __cdecl thrd_seqlock_read_begin(_In_ const thrd_seqlock_t* lock);
+// Returns true if a writer has been inside since the begin, and the reads must be retried.
+THREADS_API bool __cdecl thrd_seqlock_read_retry(_In_ const thrd_seqlock_t* lock, unsigned int seq);
+THREADS_API int __cdecl thrd_seqlock_write_lock(_In_ thrd_seqlock_t* lock);
+THREADS_API int __cdecl thrd_seqlock_write_unlock(_In_ thrd_seqlock_t* lock);
+// Copies size bytes of the data guarded by the lock out, retrying until consistent.
+THREADS_API int __cdecl thrd_seqlock_read(_In_ const thrd_seqlock_t* lock, _Out_writes_bytes_(size) void* restrict dest, _In_reads_bytes_(size) const void* restrict src, size_t size);
+// Copies size bytes into the data guarded by the lock, as a writer.
+THREADS_API int __cdecl thrd_seqlock_write(_In_ thrd_seqlock_t* lock, _Out_writes_bytes_(size) void* restrict dest, _In_reads_bytes_(size) const void* restrict src, size_t size);
+THREADS_API void __cdecl thrd_seqlock_destroy(_In_ thrd_seqlock_t* lock);
+
 // Call-once
 
+#ifdef _WIN32
 typedef INIT_ONCE once_flag;
 
 #define ONCE_FLAG_INIT INIT_ONCE_STATIC_INIT
+#else
+typedef pthread_once_t once_flag;
+
+#define ONCE_FLAG_INIT PTHREAD_ONCE_INIT
+#endif // _WIN32
 
 THREADS_API void __cdecl call_once(_In_ once_flag* flag, _In_ void(__cdecl* func)(void));
 
@@ -129,31 +361,129 @@ THREADS_API void __cdecl call_once(_In_ once_flag* flag, _In_ void(__cdecl* func
 
 typedef struct
 {
-	CONDITION_VARIABLE cv;
-	CRITICAL_SECTION cs;
+	// The lock word guarding the queue of waiters
+	volatile LONG lock;
+	struct _Cnd_waiter* head;
+	struct _Cnd_waiter* tail;
+	// The mutex of the last waiter
+	mtx_t* mutex;
 } cnd_t;
 
+#define CND_INITIALIZER { 0, NULL, NULL, NULL }
+
 THREADS_API int __cdecl cnd_init(_Out_ cnd_t* cond);
 THREADS_API int __cdecl cnd_signal(_In_ cnd_t* cond);
 THREADS_API int __cdecl cnd_broadcast(_In_ cnd_t* cond);
 THREADS_API int __cdecl cnd_wait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex);
 THREADS_API int __cdecl cnd_timedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point);
+THREADS_API int __cdecl _Cnd_clockwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, int base, _In_ const struct timespec* restrict time_point);
 THREADS_API int __cdecl _Cnd_swait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex);
 THREADS_API int __cdecl _Cnd_stimedwait(_In_ cnd_t* restrict cond, _In_ mtx_t* restrict mutex, _In_ const struct timespec* restrict time_point);
 THREADS_API void __cdecl cnd_destroy(_In_ cnd_t* cond);
 
 // Semaphore
 
-typedef HANDLE _Smph_t;
+typedef struct
+{
+	// The available count, also the address where the waiters park.
+	volatile LONG count;
+	// The number of parked or about to park threads.
+	volatile LONG waiters;
+	LONG max_count;
+} _Smph_t;
+
+#define _SMPH_INITIALIZER(max_count, count) { (count), 0, (max_count) }
+
 THREADS_API int __cdecl _Smph_init(_Out_ _Smph_t* sem, int max_count, int count);
 THREADS_API int __cdecl _Smph_wait(_In_ _Smph_t* sem);
 THREADS_API int __cdecl _Smph_timedwait(_In_ _Smph_t* restrict sem, _In_ const struct timespec* restrict time_point);
+THREADS_API int __cdecl _Smph_clockwait(_In_ _Smph_t* restrict sem, int base, _In_ const struct timespec* restrict time_point);
 THREADS_API int __cdecl _Smph_trywait(_In_ _Smph_t* sem);
 THREADS_API int __cdecl _Smph_post(_In_ _Smph_t* sem);
 THREADS_API int __cdecl _Smph_multipost(_In_ _Smph_t* sem, int count);
 THREADS_API int __cdecl _Smph_get(_In_ _Smph_t* restrict sem, int* restrict count);
 THREADS_API void __cdecl _Smph_destroy(_In_ _Smph_t* sem);
 
+// Barrier and latch
+
+// Called by the last thread arriving at a barrier, before the others are released.
+typedef void(__cdecl* thrd_barrier_completion_t)(void*);
+
+typedef struct
+{
+	// The threads yet to arrive in the current phase
+	volatile LONG count;
+	// Flipped when a phase completes, also the address where the waiters park.
+	volatile LONG sense;
+	// The number of parked or about to park threads.
+	volatile LONG waiters;
+	// The spin limit, adapted to how long the phases take.
+	volatile LONG spin;
+	LONG expected;
+	thrd_barrier_completion_t completion;
+	void* arg;
+} thrd_barrier_t;
+
+#define THRD_BARRIER_INITIALIZER(count, completion, arg) { (count), 0, 0, 0, (count), (completion), (arg) }
+
+// The completion may be NULL.
+THREADS_API int __cdecl thrd_barrier_init(_Out_ thrd_barrier_t* barrier, int count, _In_opt_ thrd_barrier_completion_t completion, void* arg);
+// Arrives and waits for the others, then the barrier is ready for the next phase.
+THREADS_API int __cdecl thrd_barrier_wait(_In_ thrd_barrier_t* barrier);
+THREADS_API void __cdecl thrd_barrier_destroy(_In_ thrd_barrier_t* barrier);
+
+typedef struct
+{
+	// The count to reach 0, also the address where the waiters park.
+	volatile LONG count;
+	// The number of parked or about to park threads.
+	volatile LONG waiters;
+	volatile LONG spin;
+} thrd_latch_t;
+
+#define THRD_LATCH_INITIALIZER(count) { (count), 0, 0 }
+
+THREADS_API int __cdecl thrd_latch_init(_Out_ thrd_latch_t* latch, int count);
+// Decreases the count by n without waiting.
+// Returns thrd_error if n is more than the count.
+THREADS_API int __cdecl thrd_latch_count_down(_In_ thrd_latch_t* latch, int n);
+// Waits for the count to reach 0.
+THREADS_API int __cdecl thrd_latch_wait(_In_ thrd_latch_t* latch);
+// Returns thrd_busy if the count has not reached 0.
+THREADS_API int __cdecl thrd_latch_try_wait(_In_ thrd_latch_t* latch);
+// Decreases the count by n, and waits for it to reach 0.
+THREADS_API int __cdecl thrd_latch_arrive_and_wait(_In_ thrd_latch_t* latch, int n);
+THREADS_API void __cdecl thrd_latch_destroy(_In_ thrd_latch_t* latch);
+
+// Event count
+
+// Blocks a thread on a condition checked without locks:
+// prepare, check the condition again, and then commit or cancel.
+typedef struct
+{
+	// Increased by every notification with waiters, also the address where the waiters park.
+	volatile LONG epoch;
+	// The number of prepared waiters
+	volatile LONG waiters;
+} thrd_eventcount_t;
+
+#define THRD_EVENTCOUNT_INITIALIZER { 0, 0 }
+
+THREADS_API int __cdecl thrd_eventcount_init(_Out_ thrd_eventcount_t* ec);
+// Gets the key to wait with, before checking the condition again.
+THREADS_API int __cdecl thrd_eventcount_prepare_wait(_In_ thrd_eventcount_t* ec, _Out_ int* key);
+// Called instead of commit if the condition turned true.
+THREADS_API int __cdecl thrd_eventcount_cancel_wait(_In_ thrd_eventcount_t* ec);
+// Waits for a notification after the key was prepared.
+THREADS_API int __cdecl thrd_eventcount_commit_wait(_In_ thrd_eventcount_t* ec, int key);
+THREADS_API int __cdecl thrd_eventcount_commit_timedwait(_In_ thrd_eventcount_t* restrict ec, int key, _In_ const struct timespec* restrict time_point);
+// Only a load if no one is waiting.
+// The change of the condition should be made by an interlocked operation,
+// or followed by a full memory barrier.
+THREADS_API int __cdecl thrd_eventcount_notify_one(_In_ thrd_eventcount_t* ec);
+THREADS_API int __cdecl thrd_eventcount_notify_all(_In_ thrd_eventcount_t* ec);
+THREADS_API void __cdecl thrd_eventcount_destroy(_In_ thrd_eventcount_t* ec);
+
 // There's already thread_local in C++
 #ifndef __cpluscplus
 #define thread_local _Thread_local
@@ -165,13 +495,294 @@ THREADS_API void __cdecl _Smph_destroy(_In_ _Smph_t* sem);
 
 typedef void(__cdecl* tss_dtor_t)(void*);
 
-typedef DWORD tss_t;
+// The low 32 bits are the index of the key, and the high 32 bits are its generation.
+// It was a 32-bit DWORD in the older versions.
+typedef unsigned long long tss_t;
 
 THREADS_API int __cdecl tss_create(_Out_ tss_t* tss_key, _In_opt_ tss_dtor_t destructor);
 THREADS_API void* __cdecl tss_get(tss_t tss_key);
+// The destructors run when the thread exits, whether or not the library created it.
 THREADS_API int __cdecl tss_set(tss_t tss_id, _In_opt_ void* val);
 THREADS_API void __cdecl tss_delete(tss_t tss_id);
 
+// A slot of the thread local table, valid only if the generation matches
+typedef struct
+{
+	void* _Value;
+	DWORD _Gen;
+	// Position + 1 in the list of the slots with values, 0 if not in it
+	DWORD _Pos;
+} _Tss_slot;
+
+// Read-copy-update
+
+typedef void(__cdecl* thrd_rcu_dtor_t)(void*);
+
+// Marks a read-side critical section, which may be nested.
+// Retired pointers read inside it stay valid until it ends.
+THREADS_API void __cdecl thrd_rcu_read_lock(void);
+THREADS_API void __cdecl thrd_rcu_read_unlock(void);
+// Calls dtor with ptr after all read-side critical sections that may see it have ended.
+// The pointer should have been unlinked from the shared data.
+// The dtor may retire more pointers. The pointers still waiting when the thread exits
+// are freed by the other threads, whether or not the library created it.
+THREADS_API int __cdecl thrd_rcu_retire(_In_opt_ void* ptr, _In_ thrd_rcu_dtor_t dtor);
+// Waits for the read-side critical sections in progress, and frees the expired pointers.
+// It should not be called inside a read-side critical section.
+THREADS_API void __cdecl thrd_rcu_synchronize(void);
+
+// Thread arena
+
+// A bump allocator owned by the calling thread.
+// Its memory is released when the thread exits, or its function of thrd_create returns.
+typedef struct
+{
+	void* block;
+	size_t used;
+} thrd_arena_mark_t;
+
+// Allocates from the arena of the calling thread, aligned for any type.
+// Returns NULL if out of memory.
+THREADS_API _Ret_maybenull_ void* __cdecl thrd_arena_alloc(size_t size);
+// Frees all allocations of the arena, keeping its first block for reuse.
+THREADS_API void __cdecl thrd_arena_reset(void);
+// Records the current position of the arena.
+THREADS_API void __cdecl thrd_arena_mark(_Out_ thrd_arena_mark_t* mark);
+// Frees the allocations after the mark, which should be taken after the last reset.
+THREADS_API void __cdecl thrd_arena_rewind(_In_ const thrd_arena_mark_t* mark);
+
+// Thread pool
+
+typedef void(__cdecl* thrd_task_t)(void*);
+
+// A work-stealing thread pool.
+// Every worker owns a Chase-Lev deque, and steals from random victims when it runs out of tasks.
+typedef struct _Thrd_pool* thrd_pool_t;
+
+// Creates a pool with the count of workers, or the count of processors if it is not positive.
+THREADS_API int __cdecl thrd_pool_create(_Out_ thrd_pool_t* pool, int workers);
+THREADS_API int __cdecl thrd_pool_submit(_In_ thrd_pool_t pool, _In_ thrd_task_t func, _In_opt_ void* arg);
+// Submits func with every arg in args, and wakes the idle workers only once.
+THREADS_API int __cdecl thrd_pool_submit_n(_In_ thrd_pool_t pool, _In_ thrd_task_t func, _In_reads_(count) void* const* args, size_t count);
+// Runs the tasks on the calling thread until all submitted tasks completed.
+// It should not be called from the workers of the same pool.
+THREADS_API int __cdecl thrd_pool_wait(_In_ thrd_pool_t pool);
+// Waits for all tasks, and joins the workers.
+THREADS_API void __cdecl thrd_pool_destroy(_In_ thrd_pool_t pool);
+
+// Channel
+
+// A bounded channel of pointers, for any number of senders and receivers.
+// It is a lock-free ring buffer, and the threads park only when it is full or empty.
+typedef struct _Thrd_chan* thrd_chan_t;
+
+// The capacity is rounded up to a power of 2.
+THREADS_API int __cdecl thrd_chan_create(_Out_ thrd_chan_t* chan, size_t capacity);
+THREADS_API int __cdecl thrd_chan_send(_In_ thrd_chan_t chan, _In_opt_ void* value);
+// Returns thrd_busy if the channel is full.
+THREADS_API int __cdecl thrd_chan_trysend(_In_ thrd_chan_t chan, _In_opt_ void* value);
+THREADS_API int __cdecl thrd_chan_timedsend(_In_ thrd_chan_t chan, _In_opt_ void* value, _In_ const struct timespec* time_point);
+// Sends all values, and wakes the receivers once for each batch that fits.
+THREADS_API int __cdecl thrd_chan_send_n(_In_ thrd_chan_t chan, _In_reads_(count) void* const* values, size_t count);
+THREADS_API int __cdecl thrd_chan_recv(_In_ thrd_chan_t chan, _Out_ void** value);
+// Returns thrd_busy if the channel is empty.
+THREADS_API int __cdecl thrd_chan_tryrecv(_In_ thrd_chan_t chan, _Out_ void** value);
+THREADS_API int __cdecl thrd_chan_timedrecv(_In_ thrd_chan_t chan, _Out_ void** value, _In_ const struct timespec* time_point);
+// Waits for at least one value, and receives at most count values without waiting more.
+THREADS_API int __cdecl thrd_chan_recv_n(_In_ thrd_chan_t chan, _Out_writes_to_(count, *received) void** values, size_t count, _Out_ size_t* received);
+// No one should be using the channel.
+THREADS_API void __cdecl thrd_chan_destroy(_In_ thrd_chan_t chan);
+
+// Single-producer single-consumer queue
+
+// A ring buffer of fixed-size elements, between exactly one producer thread and one consumer thread.
+// The elements can be written and read in place through reserve/commit and acquire/release.
+typedef struct _Thrd_spsc* thrd_spsc_t;
+
+// The capacity is rounded up to a power of 2.
+THREADS_API int __cdecl thrd_spsc_create(_Out_ thrd_spsc_t* queue, size_t capacity, size_t elem_size);
+// Copies an element in, and waits while the queue is full.
+THREADS_API int __cdecl thrd_spsc_push(_In_ thrd_spsc_t queue, _In_ const void* elem);
+// Returns thrd_busy if the queue is full.
+THREADS_API int __cdecl thrd_spsc_trypush(_In_ thrd_spsc_t queue, _In_ const void* elem);
+// Copies an element out, and waits while the queue is empty.
+THREADS_API int __cdecl thrd_spsc_pop(_In_ thrd_spsc_t queue, _Out_ void* elem);
+// Returns thrd_busy if the queue is empty.
+THREADS_API int __cdecl thrd_spsc_trypop(_In_ thrd_spsc_t queue, _Out_ void* elem);
+// Waits for free slots, and gets at most count contiguous ones to write.
+THREADS_API int __cdecl thrd_spsc_reserve(_In_ thrd_spsc_t queue, size_t count, _Out_ void** slots, _Out_ size_t* reserved);
+// Publishes the first count reserved slots.
+THREADS_API int __cdecl thrd_spsc_commit(_In_ thrd_spsc_t queue, size_t count);
+// Waits for elements, and gets at most count contiguous ones to read.
+THREADS_API int __cdecl thrd_spsc_acquire(_In_ thrd_spsc_t queue, size_t count, _Out_ void** slots, _Out_ size_t* acquired);
+// Frees the first count acquired slots for the producer.
+THREADS_API int __cdecl thrd_spsc_release(_In_ thrd_spsc_t queue, size_t count);
+THREADS_API void __cdecl thrd_spsc_destroy(_In_ thrd_spsc_t queue);
+
+// Contention profiler
+// When enabled, records the locks of mutexes, and the waits of condition variables
+// and semaphores, into tables of each thread, aggregated on demand.
+// The inline fast paths are not recorded.
+
+// Bucket 0 counts zero times, and bucket i counts times in [2^(i-1), 2^i) nanoseconds.
+#define THRD_PROF_BUCKETS 32
+// The call sites kept for each object
+#define THRD_PROF_SITES 4
+
+enum
+{
+	thrd_prof_mutex,
+	thrd_prof_shared,
+	thrd_prof_cond,
+	thrd_prof_semaphore
+};
+
+typedef struct
+{
+	void* site;
+	unsigned long long count;
+} thrd_prof_site_t;
+
+typedef struct
+{
+	const void* object;
+	// The registered name, valid until unregistered, or NULL
+	const char* name;
+	int kind;
+	unsigned long long acquired;
+	// The acquisitions which had to wait
+	unsigned long long contended;
+	unsigned long long wait_ns;
+	// Only for mutexes
+	unsigned long long hold_ns;
+	unsigned long long wait_hist[THRD_PROF_BUCKETS];
+	unsigned long long hold_hist[THRD_PROF_BUCKETS];
+	// The call sites waiting most often, approximately
+	thrd_prof_site_t sites[THRD_PROF_SITES];
+} thrd_prof_stats_t;
+
+THREADS_API int __cdecl thrd_prof_enable(bool enable);
+// Names the object in the reports, copying the name.
+THREADS_API int __cdecl thrd_prof_register(_In_ const void* object, _In_z_ const char* name);
+THREADS_API void __cdecl thrd_prof_unregister(_In_ const void* object);
+// Aggregates the stats of all threads, sorted by the total waiting time.
+// The exited threads are included, whether or not the library created them.
+// Writes at most count of them, and the number of all objects to total.
+THREADS_API int __cdecl thrd_prof_snapshot(_Out_writes_(count) thrd_prof_stats_t* stats, size_t count, _Out_ size_t* total);
+// Prints the aggregated stats, with the percentiles of the waiting times.
+THREADS_API int __cdecl thrd_prof_report(_In_ FILE* stream);
+// Drops the stats recorded so far.
+THREADS_API void __cdecl thrd_prof_reset(void);
+
+// Trace recorder
+// Compiled in with WINCTHREADS_TRACE, otherwise the functions return thrd_error.
+// Records the thread lifetimes, lock, condition and semaphore waits, notifications
+// and TSS destructors into ring buffers of each thread, written in the Chrome
+// trace event format, which Perfetto and chrome://tracing load.
+// A timed wait that gives up ends with a "result":"timedout" argument.
+
+// Starts recording, keeping the last capacity events of each thread.
+// The capacity is rounded up to a power of 2, and applies to the threads recording later.
+THREADS_API int __cdecl thrd_trace_start(size_t capacity);
+THREADS_API int __cdecl thrd_trace_stop(void);
+THREADS_API int __cdecl thrd_trace_write(_In_ FILE* stream);
+// Drops the events recorded so far, and the buffers of the exited threads.
+THREADS_API void __cdecl thrd_trace_clear(void);
+
+// Inline fast paths
+// They take the uncontended cases inline, and call the library otherwise.
+// The type of the mutex is decided by the caller at compile time.
+
+#ifdef _MSC_VER
+#define _THRD_INLINE static __forceinline
+#else
+#define _THRD_INLINE static inline
+#endif // _MSC_VER
+
+// The slow paths of the inline functions
+THREADS_API int __cdecl _Mtx_lock_slow(_In_ mtx_t* mutex);
+// Released tells whether the fast path has already unlocked the mutex.
+THREADS_API int __cdecl _Mtx_unlock_slow(_In_ mtx_t* mutex, bool released);
+// Posted tells whether the fast path has already increased the count.
+THREADS_API int __cdecl _Smph_post_slow(_In_ _Smph_t* sem, bool posted);
+
+// For plain and timed mutexes, not recursive or shared ones.
+_THRD_INLINE int _Mtx_plain_lock(_In_ mtx_t* mutex)
+{
+	if (InterlockedCompareExchange(&mutex->obj.word, 1, 0) == 0)
+		return thrd_success;
+	return _Mtx_lock_slow(mutex);
+}
+
+_THRD_INLINE int _Mtx_plain_trylock(_In_ mtx_t* mutex)
+{
+	if (mutex->obj.word == 0 && InterlockedCompareExchange(&mutex->obj.word, 1, 0) == 0)
+		return thrd_success;
+	return thrd_busy;
+}
+
+_THRD_INLINE int _Mtx_plain_unlock(_In_ mtx_t* mutex)
+{
+	if (InterlockedCompareExchange(&mutex->obj.word, 0, 1) != 1)
+		return _Mtx_unlock_slow(mutex, false);
+	// Morphed waiters of a condition variable wait for a hand-off.
+	if (ReadPointerAcquire((PVOID volatile*)&mutex->morphed))
+		return _Mtx_unlock_slow(mutex, true);
+	return thrd_success;
+}
+
+// For the shared lock of shared mutexes.
+_THRD_INLINE int _Mtx_shared_slock(_In_ mtx_t* mutex)
+{
+	if (!mutex->readers)
+	{
+		// Any flag means a writer is inside or waiting.
+		LONG state = ReadAcquire(&mutex->obj.rw.state);
+		if (!(state & ~0x00FFFFFF) && InterlockedCompareExchange(&mutex->obj.rw.state, state + 1, state) == state)
+			return thrd_success;
+	}
+	return _Mtx_slock(mutex);
+}
+
+_THRD_INLINE int _Mtx_shared_sunlock(_In_ mtx_t* mutex)
+{
+	if (!mutex->readers)
+	{
+		// No flags, no one to wake.
+		LONG state = ReadAcquire(&mutex->obj.rw.state);
+		if (state > 0 && !(state & ~0x00FFFFFF) && InterlockedCompareExchange(&mutex->obj.rw.state, state - 1, state) == state)
+			return thrd_success;
+	}
+	return _Mtx_sunlock(mutex);
+}
+
+_THRD_INLINE int _Smph_post_inline(_In_ _Smph_t* sem)
+{
+	LONG count = ReadAcquire(&sem->count);
+	if (count >= sem->max_count || InterlockedCompareExchange(&sem->count, count + 1, count) != count)
+		return _Smph_post_slow(sem, false);
+	if (ReadAcquire(&sem->waiters))
+		return _Smph_post_slow(sem, true);
+	return thrd_success;
+}
+
+#ifdef WINCTHREADS_STATIC
+// Thread local variables cannot be imported from a DLL,
+// so tss_get is inlined only for the static library.
+extern thread_local _Tss_slot* _Tss_slots;
+extern thread_local DWORD _Tss_slots_capacity;
+
+_THRD_INLINE void* _Tss_get_inline(tss_t tss_key)
+{
+	DWORD index = (DWORD)tss_key;
+	if (index < _Tss_slots_capacity && _Tss_slots[index]._Gen == (DWORD)(tss_key >> 32))
+		return _Tss_slots[index]._Value;
+	return NULL;
+}
+#else
+#define _Tss_get_inline tss_get
+#endif // WINCTHREADS_STATIC
+
 END_EXTERN_C
 
 #endif // !_INC_THREADS
@@ -0,0 +1,155 @@
+/**WinCThreads threads_posix.h
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019-2020 Berrysoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+// The subset of Windows.h used by the library, for the Linux backend.
+// Only the parts shared by both backends are here;
+// waiting, sleeping and threads have their own code in threads.c.
+#pragma once
+#ifndef _INC_THREADS_POSIX
+#define _INC_THREADS_POSIX
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define __cdecl
+#define WINAPI
+#define __forceinline inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+
+// Annotations of the Microsoft source code annotation language
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_reads_(size)
+#define _In_reads_bytes_(size)
+#define _Inout_
+#define _Out_
+#define _Out_writes_(size)
+#define _Out_writes_to_(size, count)
+#define _Out_writes_bytes_(size)
+#define _Outptr_result_maybenull_
+#define _Ret_maybenull_
+#define _Analysis_assume_(expr)
+
+typedef int BOOL;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef void* PVOID;
+typedef void* HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXLONGLONG INT64_MAX
+
+// The interlocked functions are full barriers, as on Windows.
+#define InterlockedCompareExchange(target, exchange, comparand) __sync_val_compare_and_swap((target), (comparand), (exchange))
+#define InterlockedCompareExchange64 InterlockedCompareExchange
+#define InterlockedCompareExchangePointer InterlockedCompareExchange
+#define InterlockedExchange(target, value) __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64 InterlockedExchange
+#define InterlockedExchangePointer InterlockedExchange
+#define InterlockedIncrement(target) __atomic_add_fetch((target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(target) __atomic_sub_fetch((target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(target, value) __atomic_fetch_add((target), (value), __ATOMIC_SEQ_CST)
+#define InterlockedOr(target, value) __atomic_fetch_or((target), (value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(target, value) __atomic_fetch_and((target), (value), __ATOMIC_SEQ_CST)
+
+#define ReadAcquire(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define ReadNoFence(source) __atomic_load_n((source), __ATOMIC_RELAXED)
+#define WriteRelease(destination, value) __atomic_store_n((destination), (value), __ATOMIC_RELEASE)
+#define WriteNoFence(destination, value) __atomic_store_n((destination), (value), __ATOMIC_RELAXED)
+#define ReadAcquire64 ReadAcquire
+#define ReadNoFence64 ReadNoFence
+#define WriteRelease64 WriteRelease
+#define WriteNoFence64 WriteNoFence
+#define ReadPointerAcquire ReadAcquire
+#define ReadPointerNoFence ReadNoFence
+#define WritePointerRelease WriteRelease
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define _ReadWriteBarrier() __asm__ __volatile__("" ::: "memory")
+
+#if defined(__i386__) || defined(__x86_64__)
+#define YieldProcessor() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define YieldProcessor() __asm__ __volatile__("yield")
+#else
+#define YieldProcessor() ((void)0)
+#endif
+
+static inline unsigned char _BitScanReverse(unsigned long* index, unsigned long mask)
+{
+	if (!mask) return 0;
+	*index = (unsigned long)(sizeof(unsigned long) * 8 - 1 - __builtin_clzl(mask));
+	return 1;
+}
+
+// Cached, because the owners of mutexes are checked on every lock.
+static inline DWORD GetCurrentThreadId(void)
+{
+	static __thread DWORD id = 0;
+	if (!id) id = (DWORD)syscall(SYS_gettid);
+	return id;
+}
+
+static inline DWORD GetCurrentProcessId(void)
+{
+	return (DWORD)getpid();
+}
+
+static inline BOOL SwitchToThread(void)
+{
+	return sched_yield() == 0;
+}
+
+static inline void Sleep(DWORD ms)
+{
+	if (!ms)
+	{
+		sched_yield();
+		return;
+	}
+	struct timespec span = { ms / 1000, (long)(ms % 1000) * 1000000L };
+	while (nanosleep(&span, &span)) {}
+}
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+static inline DWORD GetActiveProcessorCount(int group)
+{
+	(void)group;
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (DWORD)count : 1;
+}
+
+#endif // !_INC_THREADS_POSIX
@@ -0,0 +1,629 @@
+/**WinCThreadsBench main.c
+ * 
+ * MIT License
+ * 
+ * Copyright (c) 2019-2020 Berrysoft
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+// fopen and sscanf are fine here.
+#define _CRT_SECURE_NO_WARNINGS
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+// Used for debug
+void check_return(int res)
+{
+    assert(res == thrd_success);
+    (void)res;
+}
+
+// How long each run lasts, shortened by --quick
+#define BENCH_MILLISECONDS 500
+#define QUICK_MILLISECONDS 100
+#define MAX_THREADS 256
+#define LOCK_MAX_THREADS 64
+// Regressions below this fraction of the baseline are ignored.
+#define DEFAULT_THRESHOLD 0.1
+
+static int bench_ms = BENCH_MILLISECONDS;
+// The largest thread count of the sweeps
+static int max_threads = LOCK_MAX_THREADS;
+static int cores;
+// Only the cases containing it run, if not NULL.
+static const char* filter = NULL;
+
+// Nanoseconds of the monotonic clock
+long long now_ns(void)
+{
+    struct timespec ts;
+    _Timespec_get(&ts, TIME_MONOTONIC);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Results
+
+#define MAX_RESULTS 1024
+#define MAX_NAME 48
+
+typedef struct
+{
+    char name[MAX_NAME];
+    int threads;
+    double ops;
+} result;
+
+static result results[MAX_RESULTS];
+static int results_count = 0;
+
+void record(const char* name, int threads, double ops)
+{
+    printf("%-28s %8d %16.0f\n", name, threads, ops);
+    fflush(stdout);
+    if (results_count == MAX_RESULTS) return;
+    result* r = &results[results_count++];
+    snprintf(r->name, MAX_NAME, "%s", name);
+    r->threads = threads;
+    r->ops = ops;
+}
+
+bool selected(const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+// The thread counts of a sweep are the powers of 2 from first, and last.
+// Returns 0 after last.
+int next_threads(int n, int last)
+{
+    if (n >= last) return 0;
+    return n * 2 > last ? last : n * 2;
+}
+
+// The harness of the timed cases
+// The workers start together, run the loop until stopped,
+// and return the operations done.
+
+typedef struct bench bench;
+
+struct bench
+{
+    long long (*loop)(bench* b, int index);
+    void* data;
+    volatile LONG start;
+    volatile LONG stop;
+};
+
+typedef struct
+{
+    bench* b;
+    long long index;
+    // Operations done by the thread, alone in its cache line
+    long long ops;
+    char pad[64 - sizeof(bench*) - 2 * sizeof(long long)];
+} worker_arg;
+
+int worker_func(void* arg)
+{
+    worker_arg* w = (worker_arg*)arg;
+    while (!ReadAcquire(&w->b->start)) thrd_yield();
+    w->ops = w->b->loop(w->b, (int)w->index);
+    return 0;
+}
+
+// Runs the loop on threads_count threads, and returns the operations per second.
+double bench_run(bench* b, int threads_count)
+{
+    static worker_arg args[MAX_THREADS];
+    thrd_t threads[MAX_THREADS];
+    b->start = 0;
+    b->stop = 0;
+    for (int i = 0; i < threads_count; i++)
+    {
+        args[i].b = b;
+        args[i].index = i;
+        args[i].ops = 0;
+        check_return(thrd_create(&threads[i], worker_func, &args[i]));
+    }
+    long long begin = now_ns();
+    InterlockedExchange(&b->start, 1);
+    check_return(thrd_sleep(&(struct timespec){ .tv_nsec = bench_ms * 1000000L }, NULL));
+    InterlockedExchange(&b->stop, 1);
+    long long ops = 0;
+    for (int i = 0; i < threads_count; i++)
+    {
+        _Analysis_assume_(threads[i] != NULL);
+        check_return(thrd_join(threads[i], NULL));
+        ops += args[i].ops;
+    }
+    long long elapsed = now_ns() - begin;
+    return (double)ops * 1e9 / (double)elapsed;
+}
+
+#define RUNNING(b) (!ReadNoFence(&(b)->stop))
+
+// Locks, uncontended with 1 thread and contended with more
+
+enum
+{
+    LOCK_SPIN,
+    LOCK_MCS,
+    LOCK_MUTEX,
+};
+
+typedef struct
+{
+    int kind;
+    thrd_spinlock_t spin;
+    thrd_mcs_t mcs;
+    mtx_t mutex;
+    // Guarded by the lock
+    long long counter;
+} lock_data;
+
+long long lock_loop(bench* b, int index)
+{
+    lock_data* d = (lock_data*)b->data;
+    thrd_mcs_node_t node;
+    long long ops = 0;
+    (void)index;
+    while (RUNNING(b))
+    {
+        switch (d->kind)
+        {
+        case LOCK_SPIN:
+            check_return(thrd_spinlock_lock(&d->spin));
+            d->counter++;
+            check_return(thrd_spinlock_unlock(&d->spin));
+            break;
+        case LOCK_MCS:
+            check_return(thrd_mcs_lock(&d->mcs, &node));
+            d->counter++;
+            check_return(thrd_mcs_unlock(&d->mcs, &node));
+            break;
+        default:
+            check_return(mtx_lock(&d->mutex));
+            d->counter++;
+            check_return(mtx_unlock(&d->mutex));
+            break;
+        }
+        ops++;
+    }
+    return ops;
+}
+
+// Runs tiny critical sections, and records them per second.
+void bench_lock(const char* name, int kind, int type)
+{
+    if (!selected(name)) return;
+    static lock_data d;
+    d.kind = kind;
+    check_return(thrd_spinlock_init(&d.spin));
+    check_return(thrd_mcs_init(&d.mcs));
+    check_return(mtx_init(&d.mutex, type));
+    bench b = { lock_loop, &d, 0, 0 };
+    for (int n = 1; n; n = next_threads(n, max_threads))
+    {
+        d.counter = 0;
+        record(name, n, bench_run(&b, n));
+    }
+    thrd_spinlock_destroy(&d.spin);
+    thrd_mcs_destroy(&d.mcs);
+    mtx_destroy(&d.mutex);
+}
+
+// Shared mutex, readers only
+
+long long reader_loop(bench* b, int index)
+{
+    mtx_t* mutex = (mtx_t*)b->data;
+    long long ops = 0;
+    (void)index;
+    while (RUNNING(b))
+    {
+        check_return(_Mtx_slock(mutex));
+        check_return(_Mtx_sunlock(mutex));
+        ops++;
+    }
+    return ops;
+}
+
+void bench_readers(const char* name, int type)
+{
+    if (!selected(name)) return;
+    mtx_t mutex;
+    check_return(mtx_init(&mutex, type));
+    bench b = { reader_loop, &mutex, 0, 0 };
+    int last = cores < max_threads ? cores : max_threads;
+    for (int n = 1; n; n = next_threads(n, last))
+        record(name, n, bench_run(&b, n));
+    mtx_destroy(&mutex);
+}
+
+// Condition variable ping-pong between pairs of threads
+
+typedef struct
+{
+    mtx_t mutex;
+    cnd_t cond;
+    // Whose turn it is, 0 for the even thread and 1 for the odd one
+    int turn;
+    bool done;
+} pingpong_pair;
+
+// The even thread of a pair serves, and counts the round trips.
+long long pingpong_loop(bench* b, int index)
+{
+    pingpong_pair* p = (pingpong_pair*)b->data + index / 2;
+    long long ops = 0;
+    check_return(mtx_lock(&p->mutex));
+    if (index % 2 == 0)
+    {
+        while (RUNNING(b))
+        {
+            p->turn = 1;
+            check_return(cnd_signal(&p->cond));
+            while (p->turn != 0) check_return(cnd_wait(&p->cond, &p->mutex));
+            ops++;
+        }
+        p->done = true;
+        check_return(cnd_signal(&p->cond));
+    }
+    else
+    {
+        for (;;)
+        {
+            while (p->turn != 1 && !p->done) check_return(cnd_wait(&p->cond, &p->mutex));
+            if (p->done) break;
+            p->turn = 0;
+            check_return(cnd_signal(&p->cond));
+        }
+    }
+    check_return(mtx_unlock(&p->mutex));
+    return ops;
+}
+
+void bench_pingpong(const char* name)
+{
+    if (!selected(name)) return;
+    static pingpong_pair pairs[MAX_THREADS / 2];
+    bench b = { pingpong_loop, pairs, 0, 0 };
+    int last = cores < max_threads ? cores : max_threads;
+    if (last < 2) last = 2;
+    for (int n = 2; n; n = next_threads(n, last & ~1))
+    {
+        for (int i = 0; i < n / 2; i++)
+        {
+            check_return(mtx_init(&pairs[i].mutex, mtx_plain));
+            check_return(cnd_init(&pairs[i].cond));
+            pairs[i].turn = 0;
+            pairs[i].done = false;
+        }
+        record(name, n, bench_run(&b, n));
+        for (int i = 0; i < n / 2; i++)
+        {
+            cnd_destroy(&pairs[i].cond);
+            mtx_destroy(&pairs[i].mutex);
+        }
+    }
+}
+
+// Semaphore, each thread takes a unit and gives it back
+
+long long smph_loop(bench* b, int index)
+{
+    _Smph_t* sem = (_Smph_t*)b->data;
+    long long ops = 0;
+    (void)index;
+    while (RUNNING(b))
+    {
+        check_return(_Smph_wait(sem));
+        check_return(_Smph_post(sem));
+        ops++;
+    }
+    return ops;
+}
+
+void bench_smph(const char* name)
+{
+    if (!selected(name)) return;
+    _Smph_t sem;
+    bench b = { smph_loop, &sem, 0, 0 };
+    for (int n = 1; n; n = next_threads(n, max_threads))
+    {
+        // Half of the threads wait.
+        int units = n > 1 ? n / 2 : 1;
+        check_return(_Smph_init(&sem, units, units));
+        record(name, n, bench_run(&b, n));
+        _Smph_destroy(&sem);
+    }
+}
+
+// Thread-specific storage
+
+long long tss_get_loop(bench* b, int index)
+{
+    tss_t key = *(tss_t*)b->data;
+    long long ops = 0;
+    (void)index;
+    check_return(tss_set(key, &ops));
+    while (RUNNING(b))
+    {
+        // Batches keep the stop check out of the measure.
+        for (int i = 0; i < 64; i++)
+        {
+            long long* p = (long long*)tss_get(key);
+            (*p)++;
+        }
+    }
+    return ops;
+}
+
+long long tss_set_loop(bench* b, int index)
+{
+    tss_t key = *(tss_t*)b->data;
+    long long ops = 0;
+    (void)index;
+    while (RUNNING(b))
+    {
+        for (int i = 0; i < 64; i++)
+            check_return(tss_set(key, (void*)(intptr_t)(i + 1)));
+        ops += 64;
+    }
+    return ops;
+}
+
+void bench_tss(const char* name, long long (*loop)(bench* b, int index))
+{
+    if (!selected(name)) return;
+    tss_t key;
+    check_return(tss_create(&key, NULL));
+    bench b = { loop, &key, 0, 0 };
+    int last = cores < max_threads ? cores : max_threads;
+    for (int n = 1; n; n = next_threads(n, last))
+        record(name, n, bench_run(&b, n));
+    tss_delete(key);
+}
+
+// Thread creation
+
+int empty_func(void* arg)
+{
+    (void)arg;
+    return 0;
+}
+
+long long create_loop(bench* b, int index)
+{
+    long long ops = 0;
+    (void)index;
+    while (RUNNING(b))
+    {
+        thrd_t thr;
+        check_return(thrd_create(&thr, empty_func, NULL));
+        check_return(thrd_join(thr, NULL));
+        ops++;
+    }
+    return ops;
+}
+
+// Creates and joins threads, with the cache of parked threads or not.
+void bench_create(const char* name, bool cached)
+{
+    if (!selected(name)) return;
+    bench b = { create_loop, NULL, 0, 0 };
+    int last = cores < max_threads ? cores : max_threads;
+    for (int n = 1; n; n = next_threads(n, last))
+    {
+        check_return(thrd_set_cache_limit(cached ? n : 0));
+        record(name, n, bench_run(&b, n));
+    }
+    check_return(thrd_set_cache_limit(0));
+}
+
+// Channel
+
+#define CHAN_PRODUCERS 4
+#define CHAN_CONSUMERS 4
+#define CHAN_MESSAGES 1000000
+#define CHAN_CAPACITY 1024
+
+int producer_func(void* arg)
+{
+    thrd_chan_t chan = (thrd_chan_t)arg;
+    for (intptr_t i = 1; i <= CHAN_MESSAGES; i++)
+        check_return(thrd_chan_send(chan, (void*)i));
+    return 0;
+}
+
+int consumer_func(void* arg)
+{
+    thrd_chan_t chan = (thrd_chan_t)arg;
+    void* value;
+    do
+    {
+        check_return(thrd_chan_recv(chan, &value));
+    } while (value);
+    return 0;
+}
+
+// Runs 4 producers and 4 consumers, and records the messages per second.
+void bench_chan(const char* name)
+{
+    if (!selected(name)) return;
+    thrd_chan_t chan;
+    check_return(thrd_chan_create(&chan, CHAN_CAPACITY));
+    thrd_t producers[CHAN_PRODUCERS], consumers[CHAN_CONSUMERS];
+    long long begin = now_ns();
+    for (int i = 0; i < CHAN_CONSUMERS; i++)
+        check_return(thrd_create(&consumers[i], consumer_func, chan));
+    for (int i = 0; i < CHAN_PRODUCERS; i++)
+        check_return(thrd_create(&producers[i], producer_func, chan));
+    for (int i = 0; i < CHAN_PRODUCERS; i++)
+    {
+        _Analysis_assume_(producers[i] != NULL);
+        check_return(thrd_join(producers[i], NULL));
+    }
+    // A NULL message stops a consumer.
+    for (int i = 0; i < CHAN_CONSUMERS; i++)
+        check_return(thrd_chan_send(chan, NULL));
+    for (int i = 0; i < CHAN_CONSUMERS; i++)
+    {
+        _Analysis_assume_(consumers[i] != NULL);
+        check_return(thrd_join(consumers[i], NULL));
+    }
+    long long elapsed = now_ns() - begin;
+    thrd_chan_destroy(chan);
+    record(name, CHAN_PRODUCERS + CHAN_CONSUMERS, (double)CHAN_PRODUCERS * CHAN_MESSAGES * 1e9 / (double)elapsed);
+}
+
+// CSV and the baseline
+
+#define CSV_HEADER "case,threads,ops_per_sec"
+
+int write_csv(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+    }
+    fprintf(file, CSV_HEADER "\n");
+    for (int i = 0; i < results_count; i++)
+        fprintf(file, "%s,%d,%.0f\n", results[i].name, results[i].threads, results[i].ops);
+    fclose(file);
+    return 0;
+}
+
+// Compares the results with a CSV written before.
+// Returns the number of regressions, or -1 if the baseline cannot be read.
+int compare_baseline(const char* path, double threshold)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return -1;
+    }
+    printf("\nCompared with %s, regressions over %.0f%%\n", path, threshold * 100);
+    int regressions = 0, matched = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[MAX_NAME];
+        int threads;
+        double base;
+        // The header does not match.
+        if (sscanf(line, "%47[^,],%d,%lf", name, &threads, &base) != 3 || base <= 0) continue;
+        for (int i = 0; i < results_count; i++)
+        {
+            if (results[i].threads != threads || strcmp(results[i].name, name)) continue;
+            matched++;
+            double change = results[i].ops / base - 1;
+            if (change < -threshold)
+            {
+                printf("%-28s %8d %16.0f %16.0f %+7.1f%%\n", name, threads, base, results[i].ops, change * 100);
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(file);
+    printf("%d of %d results regressed\n", regressions, matched);
+    return regressions;
+}
+
+void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --csv FILE        write the results as CSV\n"
+        "  --baseline FILE   compare with a CSV written before, and fail on regressions\n"
+        "  --threshold PCT   ignore regressions below PCT percent, %.0f by default\n"
+        "  --max-threads N   sweep up to N threads, %d by default\n"
+        "  --filter TEXT     run only the cases containing TEXT\n"
+        "  --quick           run each case for %d ms instead of %d ms\n",
+        program, DEFAULT_THRESHOLD * 100, LOCK_MAX_THREADS, QUICK_MILLISECONDS, BENCH_MILLISECONDS);
+}
+
+int main(int argc, char** argv)
+{
+    const char* csv = NULL;
+    const char* baseline = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--csv") && has_value)
+            csv = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && has_value)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && has_value)
+            threshold = atof(argv[++i]) / 100;
+        else if (!strcmp(argv[i], "--max-threads") && has_value)
+            max_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--filter") && has_value)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--quick"))
+            bench_ms = QUICK_MILLISECONDS;
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    cores = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    if (cores > MAX_THREADS) cores = MAX_THREADS;
+
+    printf("%-28s %8s %16s\n", "case", "threads", "ops/s");
+    bench_lock("mtx_plain", LOCK_MUTEX, mtx_plain);
+    bench_lock("mtx_timed", LOCK_MUTEX, mtx_timed);
+    bench_lock("mtx_plain_recursive", LOCK_MUTEX, mtx_plain | mtx_recursive);
+    bench_lock("mtx_timed_recursive", LOCK_MUTEX, mtx_timed | mtx_recursive);
+    bench_lock("mtx_shared", LOCK_MUTEX, _Mtx_shared);
+    bench_lock("mtx_shared_distributed", LOCK_MUTEX, _Mtx_shared | _Mtx_distributed);
+    bench_lock("spinlock", LOCK_SPIN, mtx_plain);
+    bench_lock("mcs", LOCK_MCS, mtx_plain);
+    bench_readers("slock_phase_fair", _Mtx_shared);
+    bench_readers("slock_prefer_readers", _Mtx_shared | _Mtx_prefer_readers);
+    bench_readers("slock_distributed", _Mtx_shared | _Mtx_distributed);
+    bench_pingpong("cnd_ping_pong");
+    bench_smph("smph_wait_post");
+    bench_tss("tss_get", tss_get_loop);
+    bench_tss("tss_set", tss_set_loop);
+    bench_create("thrd_create_join", false);
+    bench_create("thrd_create_join_cached", true);
+    bench_chan("chan");
+
+    if (csv && write_csv(csv)) return 2;
+    if (baseline)
+    {
+        int regressions = compare_baseline(baseline, threshold);
+        if (regressions < 0) return 2;
+        if (regressions > 0) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,624 @@
+/**WinCThreadsLatency main.c
+ * 
+ * MIT License
+ * 
+ * Copyright (c) 2019-2020 Berrysoft
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+// fopen and sscanf are fine here.
+#define _CRT_SECURE_NO_WARNINGS
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+// Used for debug
+void check_return(int res)
+{
+    assert(res == thrd_success);
+    (void)res;
+}
+
+#define DEFAULT_SAMPLES 10000
+#define QUICK_SAMPLES 1000
+// The timed cases take fewer samples, because each one lasts the timeout.
+#define TIMED_SAMPLES_DIVISOR 10
+#define DEFAULT_GAP_US 100
+#define DEFAULT_TIMEOUT_US 1000
+#define MAX_LOAD 256
+// Regressions of p50 or p99 below this fraction of the baseline are ignored.
+#define DEFAULT_THRESHOLD 0.25
+
+// Where the signaler and the waiter run
+enum
+{
+    PIN_NONE,
+    // On 2 different CPUs
+    PIN_SPLIT,
+    // Both on CPU 0
+    PIN_SAME,
+};
+
+static int samples_count = DEFAULT_SAMPLES;
+static long long gap_ns = DEFAULT_GAP_US * 1000LL;
+static long long timeout_ns = DEFAULT_TIMEOUT_US * 1000LL;
+static int pin = PIN_NONE;
+static int cores;
+// Only the cases containing it run, if not NULL.
+static const char* filter = NULL;
+
+// Nanoseconds of the monotonic clock
+long long now_ns(void)
+{
+    struct timespec ts;
+    _Timespec_get(&ts, TIME_MONOTONIC);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct timespec timespec_ns(long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    return ts;
+}
+
+// Binds the calling thread to the CPU, modulo the count of CPUs.
+void pin_current(int cpu)
+{
+    cpu %= cores;
+#ifdef _WIN32
+    // The CPUs of the other processor groups are not used.
+    if (cpu < (int)(sizeof(DWORD_PTR) * 8))
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif // _WIN32
+}
+
+// Background load
+// The threads spin, and yield now and then as busy programs do.
+
+static volatile LONG load_stop = 0;
+static thrd_t load_threads[MAX_LOAD];
+static int load_count = 0;
+
+int load_func(void* arg)
+{
+    if (pin != PIN_NONE) pin_current((int)(intptr_t)arg);
+    volatile unsigned sink = 0;
+    while (!ReadAcquire(&load_stop))
+    {
+        for (unsigned i = 0; i < 100000; i++) sink += i;
+        thrd_yield();
+    }
+    return 0;
+}
+
+void load_start(int count)
+{
+    load_count = count < MAX_LOAD ? count : MAX_LOAD;
+    for (int i = 0; i < load_count; i++)
+        check_return(thrd_create(&load_threads[i], load_func, (void*)(intptr_t)i));
+}
+
+void load_end(void)
+{
+    InterlockedExchange(&load_stop, 1);
+    for (int i = 0; i < load_count; i++)
+    {
+        _Analysis_assume_(load_threads[i] != NULL);
+        check_return(thrd_join(load_threads[i], NULL));
+    }
+}
+
+// Results
+
+#define MAX_RESULTS 64
+#define MAX_NAME 32
+
+typedef struct
+{
+    char name[MAX_NAME];
+    int samples;
+    long long p50, p99, p999, max;
+} result;
+
+static result results[MAX_RESULTS];
+static int results_count = 0;
+static long long* samples;
+
+int compare_ll(const void* lhs, const void* rhs)
+{
+    long long l = *(const long long*)lhs, r = *(const long long*)rhs;
+    return (l > r) - (l < r);
+}
+
+long long percentile(const long long* sorted, int count, double q)
+{
+    int i = (int)(q * count);
+    return sorted[i < count ? i : count - 1];
+}
+
+// Sorts the samples, and records the distribution.
+void record(const char* name, int count)
+{
+    qsort(samples, (size_t)count, sizeof(long long), compare_ll);
+    result r;
+    snprintf(r.name, MAX_NAME, "%s", name);
+    r.samples = count;
+    r.p50 = percentile(samples, count, 0.5);
+    r.p99 = percentile(samples, count, 0.99);
+    r.p999 = percentile(samples, count, 0.999);
+    r.max = samples[count - 1];
+    printf("%-20s %8d %10lld %10lld %10lld %10lld\n", r.name, r.samples, r.p50, r.p99, r.p999, r.max);
+    fflush(stdout);
+    if (results_count < MAX_RESULTS) results[results_count++] = r;
+}
+
+bool selected(const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+// Wake-up latency
+// In each round the signaler arms the primitive, waits until the waiter is about to block,
+// lets it park for the gap, and then stamps the time and wakes it.
+// The waiter takes the time when it runs again.
+
+typedef struct
+{
+    const char* name;
+    // On the signaler, before the waiter blocks
+    void (*arm)(void);
+    // On the waiter, returns when woken
+    void (*block)(void);
+    // On the signaler, stamps and wakes the waiter
+    void (*fire)(void);
+} wake_case;
+
+static volatile LONG64 fired_ns;
+static volatile LONG armed_round, blocking_round, woken_round;
+
+void stamp(void)
+{
+    WriteRelease64(&fired_ns, now_ns());
+}
+
+static mtx_t plain_mutex;
+static mtx_t shared_mutex;
+static mtx_t cond_mutex;
+static cnd_t cond;
+static bool cond_flag;
+static _Smph_t sem;
+static thrd_eventcount_t eventcount;
+static volatile LONG eventcount_flag;
+static thrd_chan_t chan;
+
+void mtx_arm(void)
+{
+    check_return(mtx_lock(&plain_mutex));
+}
+
+void mtx_block(void)
+{
+    check_return(mtx_lock(&plain_mutex));
+    check_return(mtx_unlock(&plain_mutex));
+}
+
+void mtx_fire(void)
+{
+    stamp();
+    check_return(mtx_unlock(&plain_mutex));
+}
+
+// A writer waits for the last reader.
+void shared_arm(void)
+{
+    check_return(_Mtx_slock(&shared_mutex));
+}
+
+void shared_block(void)
+{
+    check_return(mtx_lock(&shared_mutex));
+    check_return(mtx_unlock(&shared_mutex));
+}
+
+void shared_fire(void)
+{
+    stamp();
+    check_return(_Mtx_sunlock(&shared_mutex));
+}
+
+void no_arm(void)
+{
+}
+
+void cnd_block(void)
+{
+    check_return(mtx_lock(&cond_mutex));
+    while (!cond_flag) check_return(cnd_wait(&cond, &cond_mutex));
+    cond_flag = false;
+    check_return(mtx_unlock(&cond_mutex));
+}
+
+void cnd_fire(void)
+{
+    check_return(mtx_lock(&cond_mutex));
+    cond_flag = true;
+    stamp();
+    check_return(cnd_signal(&cond));
+    check_return(mtx_unlock(&cond_mutex));
+}
+
+void smph_block(void)
+{
+    check_return(_Smph_wait(&sem));
+}
+
+void smph_fire(void)
+{
+    stamp();
+    check_return(_Smph_post(&sem));
+}
+
+void eventcount_block(void)
+{
+    while (!InterlockedExchange(&eventcount_flag, 0))
+    {
+        int key;
+        check_return(thrd_eventcount_prepare_wait(&eventcount, &key));
+        if (ReadAcquire(&eventcount_flag))
+            check_return(thrd_eventcount_cancel_wait(&eventcount));
+        else
+            check_return(thrd_eventcount_commit_wait(&eventcount, key));
+    }
+}
+
+void eventcount_fire(void)
+{
+    stamp();
+    InterlockedExchange(&eventcount_flag, 1);
+    check_return(thrd_eventcount_notify_one(&eventcount));
+}
+
+void chan_block(void)
+{
+    void* value;
+    check_return(thrd_chan_recv(chan, &value));
+}
+
+void chan_fire(void)
+{
+    stamp();
+    check_return(thrd_chan_send(chan, NULL));
+}
+
+static const wake_case wake_cases[] = {
+    { "mtx_unlock", mtx_arm, mtx_block, mtx_fire },
+    { "mtx_sunlock", shared_arm, shared_block, shared_fire },
+    { "cnd_signal", no_arm, cnd_block, cnd_fire },
+    { "smph_post", no_arm, smph_block, smph_fire },
+    { "eventcount_notify", no_arm, eventcount_block, eventcount_fire },
+    { "chan_send", no_arm, chan_block, chan_fire },
+};
+
+void wait_round(volatile LONG* round, LONG r)
+{
+    while (ReadAcquire(round) != r) thrd_yield();
+}
+
+int signaler_func(void* arg)
+{
+    const wake_case* c = (const wake_case*)arg;
+    if (pin != PIN_NONE) pin_current(0);
+    struct timespec gap = timespec_ns(gap_ns);
+    for (LONG r = 1; r <= samples_count; r++)
+    {
+        c->arm();
+        WriteRelease(&armed_round, r);
+        wait_round(&blocking_round, r);
+        thrd_sleep(&gap, NULL);
+        c->fire();
+        wait_round(&woken_round, r);
+    }
+    return 0;
+}
+
+int waiter_func(void* arg)
+{
+    const wake_case* c = (const wake_case*)arg;
+    if (pin != PIN_NONE) pin_current(pin == PIN_SPLIT ? 1 : 0);
+    for (LONG r = 1; r <= samples_count; r++)
+    {
+        wait_round(&armed_round, r);
+        WriteRelease(&blocking_round, r);
+        c->block();
+        long long woken = now_ns();
+        samples[r - 1] = woken - ReadAcquire64(&fired_ns);
+        WriteRelease(&woken_round, r);
+    }
+    return 0;
+}
+
+void bench_wake(const wake_case* c)
+{
+    if (!selected(c->name)) return;
+    armed_round = blocking_round = woken_round = 0;
+    thrd_t signaler, waiter;
+    check_return(thrd_create(&waiter, waiter_func, (void*)c));
+    check_return(thrd_create(&signaler, signaler_func, (void*)c));
+    check_return(thrd_join(signaler, NULL));
+    check_return(thrd_join(waiter, NULL));
+    record(c->name, samples_count);
+}
+
+// Timeout overshoot
+// Each sample is how late a timed wait returns after its deadline.
+
+typedef struct
+{
+    const char* name;
+    // Waits until the monotonic deadline, and returns when it returned.
+    long long (*wait)(long long deadline);
+} timed_case;
+
+long long sleep_wait(long long deadline)
+{
+    struct timespec span = timespec_ns(deadline - now_ns());
+    thrd_sleep(&span, NULL);
+    return now_ns();
+}
+
+long long mtx_timed_wait(long long deadline)
+{
+    // The main thread holds the mutex.
+    struct timespec ts = timespec_ns(deadline);
+    int r = _Mtx_clocklock(&plain_mutex, TIME_MONOTONIC, &ts);
+    long long returned = now_ns();
+    assert(r == thrd_timedout);
+    (void)r;
+    return returned;
+}
+
+long long cnd_timed_wait(long long deadline)
+{
+    struct timespec ts = timespec_ns(deadline);
+    check_return(mtx_lock(&cond_mutex));
+    int r;
+    do
+    {
+        r = _Cnd_clockwait(&cond, &cond_mutex, TIME_MONOTONIC, &ts);
+    } while (r == thrd_success);
+    long long returned = now_ns();
+    check_return(mtx_unlock(&cond_mutex));
+    return returned;
+}
+
+long long smph_timed_wait(long long deadline)
+{
+    struct timespec ts = timespec_ns(deadline);
+    int r = _Smph_clockwait(&sem, TIME_MONOTONIC, &ts);
+    long long returned = now_ns();
+    assert(r == thrd_timedout);
+    (void)r;
+    return returned;
+}
+
+static const timed_case timed_cases[] = {
+    { "thrd_sleep", sleep_wait },
+    { "mtx_timedlock", mtx_timed_wait },
+    { "cnd_timedwait", cnd_timed_wait },
+    { "smph_timedwait", smph_timed_wait },
+};
+
+typedef struct
+{
+    const timed_case* c;
+    int count;
+} timed_arg;
+
+int timed_func(void* arg)
+{
+    timed_arg* t = (timed_arg*)arg;
+    if (pin != PIN_NONE) pin_current(pin == PIN_SPLIT ? 1 : 0);
+    for (int i = 0; i < t->count; i++)
+    {
+        long long deadline = now_ns() + timeout_ns;
+        samples[i] = t->c->wait(deadline) - deadline;
+    }
+    return 0;
+}
+
+void bench_timed(const timed_case* c)
+{
+    if (!selected(c->name)) return;
+    timed_arg t = { c, samples_count / TIMED_SAMPLES_DIVISOR };
+    if (t.count < 1) t.count = 1;
+    thrd_t thr;
+    check_return(mtx_lock(&plain_mutex));
+    check_return(thrd_create(&thr, timed_func, &t));
+    check_return(thrd_join(thr, NULL));
+    check_return(mtx_unlock(&plain_mutex));
+    record(c->name, t.count);
+}
+
+// CSV and the baseline
+
+#define CSV_HEADER "case,samples,p50_ns,p99_ns,p999_ns,max_ns"
+
+int write_csv(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+    }
+    fprintf(file, CSV_HEADER "\n");
+    for (int i = 0; i < results_count; i++)
+    {
+        result* r = &results[i];
+        fprintf(file, "%s,%d,%lld,%lld,%lld,%lld\n", r->name, r->samples, r->p50, r->p99, r->p999, r->max);
+    }
+    fclose(file);
+    return 0;
+}
+
+// Compares p50 and p99 with a CSV written before; the rarer tails are too noisy.
+// Returns the number of regressions, or -1 if the baseline cannot be read.
+int compare_baseline(const char* path, double threshold)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return -1;
+    }
+    printf("\nCompared with %s, regressions over %.0f%%\n", path, threshold * 100);
+    int regressions = 0, matched = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[MAX_NAME];
+        int count;
+        long long p50, p99;
+        // The header does not match.
+        if (sscanf(line, "%31[^,],%d,%lld,%lld", name, &count, &p50, &p99) != 4) continue;
+        for (int i = 0; i < results_count; i++)
+        {
+            result* r = &results[i];
+            if (strcmp(r->name, name)) continue;
+            matched++;
+            if (r->p50 > p50 * (1 + threshold) || r->p99 > p99 * (1 + threshold))
+            {
+                printf("%-20s p50 %lld -> %lld, p99 %lld -> %lld\n", name, p50, r->p50, p99, r->p99);
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(file);
+    printf("%d of %d results regressed\n", regressions, matched);
+    return regressions;
+}
+
+void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --samples N       take N wake-ups of each primitive, %d by default\n"
+        "  --gap US          let the waiter park for US microseconds, %d by default\n"
+        "  --timeout US      time out the timed waits after US microseconds, %d by default\n"
+        "  --load N          run N threads of background load\n"
+        "  --pin split|same  pin the signaler and the waiter to different CPUs or the same one\n"
+        "  --csv FILE        write the results as CSV\n"
+        "  --baseline FILE   compare with a CSV written before, and fail on regressions\n"
+        "  --threshold PCT   ignore regressions below PCT percent, %.0f by default\n"
+        "  --filter TEXT     run only the cases containing TEXT\n"
+        "  --quick           take %d samples\n",
+        program, DEFAULT_SAMPLES, DEFAULT_GAP_US, DEFAULT_TIMEOUT_US, DEFAULT_THRESHOLD * 100, QUICK_SAMPLES);
+}
+
+int main(int argc, char** argv)
+{
+    const char* csv = NULL;
+    const char* baseline = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int load = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--samples") && has_value)
+            samples_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--gap") && has_value)
+            gap_ns = atoll(argv[++i]) * 1000;
+        else if (!strcmp(argv[i], "--timeout") && has_value)
+            timeout_ns = atoll(argv[++i]) * 1000;
+        else if (!strcmp(argv[i], "--load") && has_value)
+            load = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--pin") && has_value && !strcmp(argv[i + 1], "split"))
+            pin = PIN_SPLIT, i++;
+        else if (!strcmp(argv[i], "--pin") && has_value && !strcmp(argv[i + 1], "same"))
+            pin = PIN_SAME, i++;
+        else if (!strcmp(argv[i], "--csv") && has_value)
+            csv = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && has_value)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && has_value)
+            threshold = atof(argv[++i]) / 100;
+        else if (!strcmp(argv[i], "--filter") && has_value)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--quick"))
+            samples_count = QUICK_SAMPLES;
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (samples_count < 1) samples_count = 1;
+    if (gap_ns < 0) gap_ns = 0;
+    if (timeout_ns < 0) timeout_ns = 0;
+    cores = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    samples = (long long*)malloc(sizeof(long long) * (size_t)samples_count);
+    if (!samples) return 2;
+
+    check_return(mtx_init(&plain_mutex, mtx_timed));
+    check_return(mtx_init(&shared_mutex, _Mtx_shared));
+    check_return(mtx_init(&cond_mutex, mtx_plain));
+    check_return(cnd_init(&cond));
+    check_return(_Smph_init(&sem, 1, 0));
+    check_return(thrd_eventcount_init(&eventcount));
+    check_return(thrd_chan_create(&chan, 1));
+    load_start(load);
+
+    printf("Latency in nanoseconds, %d load threads, %s\n", load_count,
+        pin == PIN_SPLIT ? "pinned to 2 CPUs" : pin == PIN_SAME ? "pinned to 1 CPU" : "not pinned");
+    printf("%-20s %8s %10s %10s %10s %10s\n", "case", "samples", "p50", "p99", "p99.9", "max");
+    for (size_t i = 0; i < sizeof(wake_cases) / sizeof(wake_cases[0]); i++)
+        bench_wake(&wake_cases[i]);
+    for (size_t i = 0; i < sizeof(timed_cases) / sizeof(timed_cases[0]); i++)
+        bench_timed(&timed_cases[i]);
+
+    load_end();
+    thrd_chan_destroy(chan);
+    thrd_eventcount_destroy(&eventcount);
+    _Smph_destroy(&sem);
+    cnd_destroy(&cond);
+    mtx_destroy(&cond_mutex);
+    mtx_destroy(&shared_mutex);
+    mtx_destroy(&plain_mutex);
+    free(samples);
+
+    if (csv && write_csv(csv)) return 2;
+    if (baseline)
+    {
+        int regressions = compare_baseline(baseline, threshold);
+        if (regressions < 0) return 2;
+        if (regressions > 0) return 1;
+    }
+    return 0;
+}
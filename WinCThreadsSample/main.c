@@ -58,6 +58,93 @@ void free_print_2(void* p)
     free(p);
 }
 
+// A list retired node by node: the destructor of a node retires the next one.
+typedef struct list_node
+{
+    struct list_node* next;
+} list_node;
+
+#define LIST_COUNT 200
+#define LIST_LENGTH 8
+
+int freedNodes;
+
+void free_list_node(void* p)
+{
+    list_node* node = p;
+    if (node->next) check_return(thrd_rcu_retire(node->next, free_list_node));
+    freedNodes++;
+    free(node);
+}
+
+// Returns 0 if all nodes are freed after some grace periods.
+int retire_lists(void)
+{
+    for (int i = 0; i < LIST_COUNT; i++)
+    {
+        list_node* head = NULL;
+        for (int j = 0; j < LIST_LENGTH; j++)
+        {
+            list_node* node = malloc(sizeof(list_node));
+            if (!node) return 1;
+            node->next = head;
+            head = node;
+        }
+        check_return(thrd_rcu_retire(head, free_list_node));
+    }
+    // Every grace period frees one more node of each list.
+    for (int i = 0; i < 2 * LIST_LENGTH && freedNodes < LIST_COUNT * LIST_LENGTH; i++)
+        thrd_rcu_synchronize();
+    printf("Freed %d of %d list nodes.\n", freedNodes, LIST_COUNT * LIST_LENGTH);
+    return freedNodes != LIST_COUNT * LIST_LENGTH;
+}
+
+// Threads not created by the library also run the TSS destructors when they exit.
+#define FOREIGN_COUNT 20
+
+tss_t foreign_key;
+int foreignFreed;
+
+void free_foreign(void* p)
+{
+    foreignFreed++;
+    free(p);
+}
+
+#ifdef _WIN32
+DWORD WINAPI foreign_func(LPVOID arg)
+#else
+void* foreign_func(void* arg)
+#endif // _WIN32
+{
+    (void)arg;
+    check_return(tss_set(foreign_key, malloc(sizeof(int))));
+    return 0;
+}
+
+// Returns 0 if the values of all threads are freed.
+int run_foreign(void)
+{
+    check_return(tss_create(&foreign_key, free_foreign));
+    // One by one, so that the destructors need no lock.
+    for (int i = 0; i < FOREIGN_COUNT; i++)
+    {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, foreign_func, NULL, 0, NULL);
+        if (!thread) return 1;
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, foreign_func, NULL)) return 1;
+        pthread_join(thread, NULL);
+#endif // _WIN32
+    }
+    tss_delete(foreign_key);
+    printf("Freed %d of %d foreign values.\n", foreignFreed, FOREIGN_COUNT);
+    return foreignFreed != FOREIGN_COUNT;
+}
+
 int thread_func(void* arg)
 {
     int thrd_id = (int)(intptr_t)arg;
@@ -148,5 +235,7 @@ int main()
     mtx_destroy(&cond_mutex);
     cnd_destroy(&cond);
     _Smph_destroy(&sem);
-    return 0;
+    int failed = retire_lists();
+    failed |= run_foreign();
+    return failed;
 }